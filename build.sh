@@ -0,0 +1,24 @@
+#!/bin/sh
+
+if [ -z "$1" ]; then
+	echo "Enter build mode: d or r"
+	exit 1
+fi
+
+if [ "$1" = d ]; then
+	echo "Debug Build"
+	MODE="-O0 -DDEBUG_MODE -DVULKAN_VALIDATION_LAYERS_ON"
+fi
+if [ "$1" = r ]; then
+	echo "Release Build"
+	MODE="-O2"
+fi
+
+COMPILER_FLAGS="$MODE -std=c++17 -g -ffast-math -Wall -Wno-write-strings -Wno-unused-function -Wno-unused-variable -Wno-sign-compare"
+LINKER_FLAGS="-lpthread -ldl"
+EXE_NAME=main
+
+mkdir -p build
+cd build
+
+${CXX:-c++} $COMPILER_FLAGS ../code/main.cpp -o $EXE_NAME $LINKER_FLAGS
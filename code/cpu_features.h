@@ -0,0 +1,84 @@
+/* date = October 17th 2026 2:40 pm */
+
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// NOTE(heyyod): msvc lets us use any intrinsic without special flags. gcc and clang
+// need the target attribute on the functions that use instructions above the
+// baseline, so that we can still dispatch at runtime from one binary.
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#define TARGET_AVX2_FMA
+#define TARGET_AVX512BW
+#else
+#include <cpuid.h>
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX2_FMA __attribute__((target("avx2,fma")))
+#define TARGET_AVX512BW __attribute__((target("avx512f,avx512bw")))
+#endif
+#include <immintrin.h>
+
+struct cpu_features
+{
+    bool sse41;
+    bool avx2;
+    bool fma;
+    bool avx512bw;
+};
+
+func void
+CpuId(u32 leaf, u32 subleaf, u32 *regs)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    __cpuidex((int *)regs, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+func u64
+XGetBv()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    return _xgetbv(0);
+#else
+    u32 eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((u64)edx << 32) | eax;
+#endif
+}
+
+func cpu_features
+GetCpuFeatures()
+{
+    cpu_features features = {};
+
+    u32 regs[4] = {};
+    CpuId(0, 0, regs);
+    u32 maxLeaf = regs[0];
+    if (maxLeaf < 1)
+        return features;
+
+    CpuId(1, 0, regs);
+    features.sse41 = (regs[2] >> 19) & 1;
+    bool osxsave = (regs[2] >> 27) & 1;
+
+    // NOTE(heyyod): The os also has to save the ymm/zmm registers on context switches
+    u64 xcr0 = osxsave ? XGetBv() : 0;
+    bool osAvx = (xcr0 & 0x6) == 0x6;
+    bool osAvx512 = (xcr0 & 0xE6) == 0xE6;
+    features.fma = osAvx && ((regs[2] >> 12) & 1);
+
+    if (maxLeaf >= 7)
+    {
+        CpuId(7, 0, regs);
+        features.avx2 = osAvx && ((regs[1] >> 5) & 1);
+        features.avx512bw = osAvx512 && ((regs[1] >> 16) & 1) && ((regs[1] >> 30) & 1);
+    }
+    return features;
+}
+
+#endif //CPU_FEATURES_H
@@ -3,13 +3,11 @@
 #ifndef DATA_H
 #define DATA_H
 
-#define PIXELS_PER_IMAGE 28*28
-#define NUM_TRAIN_IMAGES 60000
-#define NUM_TEST_IMAGES 10000
-#define NUM_CLASSES 10
+#include <cstring>
+#include "file_mapping.h"
 
-#define EndianSwap(x) (x = (x>>24)|((x<<8)&0x00FF0000)|((x>>8)&0x0000FF00)|(x<<24))
-#define DataSize(nImages) (nImages * PIXELS_PER_IMAGE)
+// NOTE(heyyod): Labels are stored as u8. The actual number of classes comes from the data.
+#define MAX_CLASSES 256
 
 /* 
  The training set contains 60000 examples, and the test set 10000 examples.
@@ -42,72 +40,442 @@ xxxx     unsigned byte   ??               pixel
 Pixels are organized row-wise. Pixel values are 0 to 255. 0 means background (white), 255 means foreground (black). 
 */
 
+// NOTE(heyyod): Pixels sorted by their variance over the training set, highest first.
+// Pixels that never change (the always-zero border on mnist) are dropped, since they add
+// the same amount to the distance from a test image to every training image. For mnist
+// that is ~67 of the 784 pixels. The kept pixels are padded with zeros up to the stride.
+struct pixel_order
+{
+    u32 nPixels;   // pixels per original image
+    u32 nKept;     // pixels with non-zero variance
+    u32 stride;    // nKept padded to 16
+    u32 *order;    // [nPixels] the first nKept are kept, the rest are dropped
+    u8 *constants; // [nPixels - nKept] the value of each dropped pixel
+};
+
 struct image_data
 {
     u32 nImages;
     u32 pixelsPerImg; // per image
+    u32 nClasses;     // largest label + 1
+    u32 width, height;
     u8 *pixels;
     u8 *labels;
     
+    // NOTE(heyyod): Optional copy of the pixels in the layout of a pixel_order (see OrderPixels)
+    pixel_order *order;
+    u8 *orderedPixels;
+    
+    // NOTE(heyyod): Only there when the data comes from a dataset cache (see dataset_cache.h)
+    f32 *normalizedPixels; // pixel / 255
+    u32 *l1Norms;          // sum of the pixels of each image
+    u32 *squaredNorms;     // sum of the squared pixels of each image
+    u32 *classOffsets;     // [nClasses + 1] the images of class c are classImages[classOffsets[c]..classOffsets[c + 1]]
+    u32 *classImages;
+    
+    // NOTE(heyyod): Set when pixels point into the mapped idx file (see MapData)
+    mapped_file imagesMapping;
+    // NOTE(heyyod): Set when everything points into a mapped dataset cache
+    mapped_file cacheMapping;
+    
     inline u8 GetPixel(u32 imgIndex, u32 pxlIndex)
     {
         return pixels[imgIndex * pixelsPerImg + pxlIndex];
     }
 };
 
+func void
+FreeData(image_data &data)
+{
+    if (data.cacheMapping.memory)
+        UnmapFile(data.cacheMapping);
+    else
+    {
+        if (data.imagesMapping.memory)
+            UnmapFile(data.imagesMapping);
+        else
+            free(data.pixels);
+        free(data.labels);
+    }
+    free(data.orderedPixels);
+    data = {};
+}
+
+// NOTE(heyyod): The general idx format. The magic number is 0x00 0x00 <dtype> <number of
+// dimensions>, followed by one big endian u32 per dimension and then the data, big endian
+// and row-major. The first dimension is the number of items. Mnist is the u8 case above.
+enum idx_dtype
+{
+    IDX_DTYPE_U8  = 0x08,
+    IDX_DTYPE_I8  = 0x09,
+    IDX_DTYPE_I16 = 0x0B,
+    IDX_DTYPE_I32 = 0x0C,
+    IDX_DTYPE_F32 = 0x0D,
+    IDX_DTYPE_F64 = 0x0E,
+};
+
+#define IDX_MAX_DIMS 8
+
+struct idx_file
+{
+    u32 dtype;
+    u32 elementSize;
+    u32 nDims;
+    u32 dims[IDX_MAX_DIMS];
+    u64 nItems;          // dims[0]
+    u64 elementsPerItem; // product of the other dims
+    u8 *data;
+};
+
+func u32
+ReadBigEndianU32(u8 *bytes)
+{
+    return ((u32)bytes[0] << 24) | ((u32)bytes[1] << 16) | ((u32)bytes[2] << 8) | (u32)bytes[3];
+}
+
+func u32
+IdxElementSize(u32 dtype)
+{
+    switch (dtype)
+    {
+        case IDX_DTYPE_U8:
+        case IDX_DTYPE_I8: return 1;
+        case IDX_DTYPE_I16: return 2;
+        case IDX_DTYPE_I32:
+        case IDX_DTYPE_F32: return 4;
+        case IDX_DTYPE_F64: return 8;
+    }
+    return 0;
+}
+
 func bool
-ReadData(char *imagesFilepath, char *labelsFilepath, image_data &dataOut)
+ParseIdx(u8 *memory, u64 size, idx_file &idxOut)
 {
-    FILE *imagesFile = fopen(imagesFilepath, "rb");
-    FILE *labelsFile = fopen(labelsFilepath, "rb");
-    if (!imagesFile || !labelsFile)
+    idxOut = {};
+    if (size < 4 || memory[0] != 0 || memory[1] != 0)
+        return false;
+    
+    idxOut.dtype = memory[2];
+    idxOut.elementSize = IdxElementSize(idxOut.dtype);
+    idxOut.nDims = memory[3];
+    if (!idxOut.elementSize || idxOut.nDims == 0 || idxOut.nDims > IDX_MAX_DIMS)
+        return false;
+    
+    u64 headerSize = 4 + 4 * (u64)idxOut.nDims;
+    if (size < headerSize)
+        return false;
+    
+    idxOut.elementsPerItem = 1;
+    for (u32 iDim = 0; iDim < idxOut.nDims; iDim++)
     {
+        idxOut.dims[iDim] = ReadBigEndianU32(memory + 4 + 4 * iDim);
+        if (iDim > 0)
+        {
+            idxOut.elementsPerItem *= idxOut.dims[iDim];
+            if (idxOut.elementsPerItem > U32_MAX)
+                return false;
+        }
+    }
+    idxOut.nItems = idxOut.dims[0];
+    
+    // NOTE(heyyod): The algorithms index the pixels with u32
+    u64 nElements = idxOut.nItems * idxOut.elementsPerItem;
+    if (nElements > U32_MAX || size - headerSize < nElements * idxOut.elementSize)
         return false;
+    
+    idxOut.data = memory + headerSize;
+    return true;
+}
+
+func f64
+IdxElement(idx_file &idx, u64 index)
+{
+    u8 *bytes = idx.data + index * idx.elementSize;
+    switch (idx.dtype)
+    {
+        case IDX_DTYPE_U8: return bytes[0];
+        case IDX_DTYPE_I8: return (i8)bytes[0];
+        case IDX_DTYPE_I16: return (i16)(((u16)bytes[0] << 8) | bytes[1]);
+        case IDX_DTYPE_I32: return (i32)ReadBigEndianU32(bytes);
+        case IDX_DTYPE_F32:
+        {
+            u32 bits = ReadBigEndianU32(bytes);
+            f32 value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        case IDX_DTYPE_F64:
+        {
+            u64 bits = ((u64)ReadBigEndianU32(bytes) << 32) | ReadBigEndianU32(bytes + 4);
+            f64 value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+    }
+    return 0.0;
+}
+
+// NOTE(heyyod): Everything downstream works on u8 pixels. The other types are mapped to
+// 0-255 by the range of the type, never by the values in the file, so the train and test
+// sets always get the same mapping: the signed integers from their whole range
+// (i8 is shifted by 128) and the floats from [0, 1], with anything outside clamped.
+func void
+ConvertIdxPixels(idx_file &images, u8 *pixelsOut)
+{
+    u64 nElements = images.nItems * images.elementsPerItem;
+    if (images.dtype == IDX_DTYPE_U8)
+    {
+        memcpy(pixelsOut, images.data, nElements);
+        return;
     }
     
-    // NOTE(heyyod): Read Pixels
-    u32 magicNumber;
-    u32 imagesCount;
-    u32 rowCount;
-    u32 columnCount;
-    fread(&magicNumber, sizeof(magicNumber), 1, imagesFile);
-    fread(&imagesCount, sizeof(imagesCount), 1, imagesFile);
-    fread(&rowCount, sizeof(rowCount), 1, imagesFile);
-    fread(&columnCount, sizeof(columnCount), 1, imagesFile);
-    EndianSwap(magicNumber);
-    EndianSwap(imagesCount);
-    EndianSwap(rowCount);
-    EndianSwap(columnCount);
-    
-    dataOut.nImages = imagesCount;
-    dataOut.pixelsPerImg= rowCount * columnCount;
-    
-    u32 nPixels = imagesCount * rowCount * columnCount;
-    if (!dataOut.pixels)
-        dataOut.pixels = (u8 *)malloc(nPixels * sizeof(u8));
-    fread(dataOut.pixels, sizeof(u8), nPixels, imagesFile);
-    
-    // NOTE(heyyod): Read Labels
-    u32 labelsCount;
-    fread(&magicNumber, sizeof(magicNumber), 1, labelsFile);
-    fread(&labelsCount, sizeof(labelsCount), 1, labelsFile);
-    EndianSwap(magicNumber);
-    EndianSwap(labelsCount);
-    
-    if (!dataOut.labels)
-        dataOut.labels = (u8 *)malloc(labelsCount * sizeof(u8));
-    fread(dataOut.labels, sizeof(u8), labelsCount, labelsFile);
-    
-    fclose(imagesFile);
-    fclose(labelsFile);
+    f64 minValue = 0.0;
+    f64 maxValue = 1.0;
+    switch (images.dtype)
+    {
+        case IDX_DTYPE_I8: minValue = -128.0; maxValue = 127.0; break;
+        case IDX_DTYPE_I16: minValue = -32768.0; maxValue = 32767.0; break;
+        case IDX_DTYPE_I32: minValue = -2147483648.0; maxValue = 2147483647.0; break;
+    }
+    f64 scale = 255.0 / (maxValue - minValue);
+    
+    for (u64 i = 0; i < nElements; i++)
+    {
+        f64 value = (IdxElement(images, i) - minValue) * scale;
+        value = Min(Max(value, 0.0), 255.0);
+        pixelsOut[i] = (u8)(value + 0.5);
+    }
+}
+
+// NOTE(heyyod): Labels have to be integers that fit in a u8.
+// Returns the number of classes (largest label + 1) or 0 if a label is invalid.
+func u32
+ConvertIdxLabels(idx_file &labels, u8 *labelsOut)
+{
+    u32 maxLabel = 0;
+    for (u64 i = 0; i < labels.nItems; i++)
+    {
+        f64 label = IdxElement(labels, i);
+        if (label < 0.0 || label >= MAX_CLASSES || label != (f64)(u32)label)
+            return 0;
+        labelsOut[i] = (u8)label;
+        maxLabel = Max(maxLabel, (u32)label);
+    }
+    return maxLabel + 1;
+}
+
+// NOTE(heyyod): Checks that the two files go together and fills in the shape of the data
+func bool
+ReadIdxShape(idx_file &images, idx_file &labels, image_data &dataOut)
+{
+    if (images.nDims < 2 || labels.elementsPerItem != 1 || labels.nItems != images.nItems ||
+        labels.dtype == IDX_DTYPE_F32 || labels.dtype == IDX_DTYPE_F64)
+        return false;
+    
+    dataOut.nImages = (u32)images.nItems;
+    dataOut.pixelsPerImg = (u32)images.elementsPerItem;
+    dataOut.height = (images.nDims == 3) ? images.dims[1] : 1;
+    dataOut.width = dataOut.pixelsPerImg / dataOut.height;
     return true;
 }
 
+func u8 *
+ReadEntireFile(char *filepath, u64 &sizeOut)
+{
+    FILE *file = fopen(filepath, "rb");
+    if (!file)
+        return 0;
+    
+    sizeOut = GetFileSize(filepath);
+    
+    u8 *memory = (u8 *)malloc(Max(sizeOut, 1ull));
+    if (memory && fread(memory, 1, sizeOut, file) != sizeOut)
+    {
+        free(memory);
+        memory = 0;
+    }
+    fclose(file);
+    return memory;
+}
+
+// NOTE(heyyod): Reads a private copy of the data
+func bool
+ReadData(char *imagesFilepath, char *labelsFilepath, image_data &dataOut)
+{
+    u64 imagesSize = 0, labelsSize = 0;
+    u8 *imagesMemory = ReadEntireFile(imagesFilepath, imagesSize);
+    u8 *labelsMemory = ReadEntireFile(labelsFilepath, labelsSize);
+    
+    idx_file images, labels;
+    bool valid = imagesMemory && labelsMemory &&
+        ParseIdx(imagesMemory, imagesSize, images) &&
+        ParseIdx(labelsMemory, labelsSize, labels) &&
+        ReadIdxShape(images, labels, dataOut);
+    if (valid)
+    {
+        dataOut.pixels = (u8 *)malloc(Max((u64)dataOut.nImages * dataOut.pixelsPerImg, 1ull));
+        dataOut.labels = (u8 *)malloc(Max(dataOut.nImages, 1u));
+        ConvertIdxPixels(images, dataOut.pixels);
+        dataOut.nClasses = ConvertIdxLabels(labels, dataOut.labels);
+        valid = dataOut.nClasses > 0;
+        if (!valid)
+            FreeData(dataOut);
+    }
+    if (!valid)
+        Print("Invalid idx files: " << imagesFilepath << ", " << labelsFilepath << "\n");
+    
+    free(imagesMemory);
+    free(labelsMemory);
+    return valid;
+}
+
+// NOTE(heyyod): Same as ReadData but u8 data is not copied. pixels and labels point into the
+// mapped files right after the idx headers, so they are read only and stay valid until
+// FreeData. Other types are converted to a private copy and the file is unmapped.
+func bool
+MapData(char *imagesFilepath, char *labelsFilepath, image_data &dataOut)
+{
+    mapped_file imagesFile, labelsFile;
+    if (!MapFile(imagesFilepath, imagesFile))
+        return false;
+    if (!MapFile(labelsFilepath, labelsFile))
+    {
+        UnmapFile(imagesFile);
+        return false;
+    }
+    
+    idx_file images, labels;
+    bool valid = ParseIdx(imagesFile.memory, imagesFile.size, images) &&
+        ParseIdx(labelsFile.memory, labelsFile.size, labels) &&
+        ReadIdxShape(images, labels, dataOut);
+    if (valid)
+    {
+        // NOTE(heyyod): Every algorithm goes over the whole set, so have the os read it in
+        // in the background while we set up
+        AdviseMapping(imagesFile, MAP_ADVICE_WILLNEED);
+        
+        if (images.dtype == IDX_DTYPE_U8)
+        {
+            dataOut.pixels = images.data;
+            dataOut.imagesMapping = imagesFile;
+        }
+        else
+        {
+            dataOut.pixels = (u8 *)malloc(Max((u64)dataOut.nImages * dataOut.pixelsPerImg, 1ull));
+            ConvertIdxPixels(images, dataOut.pixels);
+            UnmapFile(imagesFile);
+        }
+        
+        // NOTE(heyyod): The labels are small, always convert them since we have to check
+        // them for the number of classes anyway
+        dataOut.labels = (u8 *)malloc(Max(dataOut.nImages, 1u));
+        dataOut.nClasses = ConvertIdxLabels(labels, dataOut.labels);
+        UnmapFile(labelsFile);
+        
+        valid = dataOut.nClasses > 0;
+        if (!valid)
+            FreeData(dataOut);
+    }
+    else
+    {
+        UnmapFile(imagesFile);
+        UnmapFile(labelsFile);
+    }
+    
+    if (!valid)
+        Print("Invalid idx files: " << imagesFilepath << ", " << labelsFilepath << "\n");
+    return valid;
+}
+
+
+struct pixel_variance
+{
+    u64 variance; // scaled by nImages^2
+    u32 pixel;
+};
+
+func int
+ComparePixelVariance(const void *a, const void *b)
+{
+    u64 varA = ((pixel_variance *)a)->variance;
+    u64 varB = ((pixel_variance *)b)->variance;
+    if (varA != varB)
+        return (varA > varB) ? -1 : 1;
+    // NOTE(heyyod): Keep the original order on ties so the result is deterministic
+    return (i32)((pixel_variance *)a)->pixel - (i32)((pixel_variance *)b)->pixel;
+}
+
 func void
-FreeData(image_data &data)
+ComputePixelOrder(image_data &trainData, pixel_order &orderOut)
+{
+    u32 nPixels = trainData.pixelsPerImg;
+    u64 *sums = (u64 *)calloc(nPixels, sizeof(u64));
+    u64 *squareSums = (u64 *)calloc(nPixels, sizeof(u64));
+    for (u32 iImg = 0; iImg < trainData.nImages; iImg++)
+    {
+        u8 *img = &trainData.pixels[iImg * nPixels];
+        for (u32 iPixel = 0; iPixel < nPixels; iPixel++)
+        {
+            sums[iPixel] += img[iPixel];
+            squareSums[iPixel] += (u32)img[iPixel] * img[iPixel];
+        }
+    }
+    
+    // NOTE(heyyod): n^2 * var = n * sum(x^2) - sum(x)^2, exact in integers
+    pixel_variance *variances = (pixel_variance *)malloc(nPixels * sizeof(pixel_variance));
+    u64 n = trainData.nImages;
+    for (u32 iPixel = 0; iPixel < nPixels; iPixel++)
+    {
+        variances[iPixel].variance = n * squareSums[iPixel] - sums[iPixel] * sums[iPixel];
+        variances[iPixel].pixel = iPixel;
+    }
+    qsort(variances, nPixels, sizeof(pixel_variance), ComparePixelVariance);
+    
+    orderOut.nPixels = nPixels;
+    orderOut.nKept = 0;
+    orderOut.order = (u32 *)malloc(nPixels * sizeof(u32));
+    for (u32 i = 0; i < nPixels; i++)
+    {
+        orderOut.order[i] = variances[i].pixel;
+        if (variances[i].variance > 0)
+            orderOut.nKept++;
+    }
+    orderOut.stride = (orderOut.nKept + 15) & ~15u;
+    
+    u32 nDropped = nPixels - orderOut.nKept;
+    orderOut.constants = (u8 *)malloc(Max(nDropped, 1u) * sizeof(u8));
+    for (u32 i = 0; i < nDropped; i++)
+        orderOut.constants[i] = trainData.nImages ? trainData.pixels[orderOut.order[orderOut.nKept + i]] : 0;
+    
+    free(variances);
+    free(sums);
+    free(squareSums);
+}
+
+func void
+FreePixelOrder(pixel_order &order)
+{
+    free(order.order);
+    free(order.constants);
+    order = {};
+}
+
+// NOTE(heyyod): Writes the kept pixels of every image in variance order to data.orderedPixels
+func void
+OrderPixels(pixel_order &order, image_data &data)
 {
-    free(data.pixels);
-    free(data.labels);
+    Assert(data.pixelsPerImg == order.nPixels);
+    data.order = &order;
+    if (!data.orderedPixels)
+        data.orderedPixels = (u8 *)calloc((u64)data.nImages * order.stride, sizeof(u8));
+    
+    for (u32 iImg = 0; iImg < data.nImages; iImg++)
+    {
+        u8 *src = &data.pixels[iImg * data.pixelsPerImg];
+        u8 *dst = &data.orderedPixels[(u64)iImg * order.stride];
+        for (u32 i = 0; i < order.nKept; i++)
+            dst[i] = src[order.order[i]];
+    }
 }
 
 func void
@@ -0,0 +1,319 @@
+/* date = October 18th 2026 11:20 am */
+
+#ifndef DATASET_CACHE_H
+#define DATASET_CACHE_H
+
+#include "data.h"
+
+// NOTE(heyyod): Everything the algorithms need from a dataset, precomputed and laid out so
+// that the file can be mapped and used in place:
+//   header | pixels (u8) | normalized pixels (f32, pixel / 255) | l1 norms (u32) |
+//   squared l2 norms (u32) | labels (u8) | class offsets (u32, nClasses + 1) |
+//   class images (u32, image indices grouped by class)
+// Every section starts at a multiple of DATASET_CACHE_ALIGNMENT from the start of the file
+// and is zero padded up to the next one. The checksum covers everything after the header, it
+// is only checked right after the cache is built so a load doesn't read the whole file.
+// The sizes and modification times of the idx files are stored so a cache of different
+// source files gets rebuilt, even when they have the same size (mnist and fashion-mnist do).
+#define DATASET_CACHE_MAGIC 0x4E4E4B48 // "HKNN"
+#define DATASET_CACHE_VERSION 3
+#define DATASET_CACHE_ALIGNMENT 64
+
+enum dataset_cache_section
+{
+    DATASET_SECTION_PIXELS,
+    DATASET_SECTION_NORMALIZED_PIXELS,
+    DATASET_SECTION_L1_NORMS,
+    DATASET_SECTION_SQUARED_NORMS,
+    DATASET_SECTION_LABELS,
+    DATASET_SECTION_CLASS_OFFSETS,
+    DATASET_SECTION_CLASS_IMAGES,
+
+    DATASET_SECTION_COUNT
+};
+
+struct dataset_cache_header
+{
+    u32 magic;
+    u32 version;
+    u32 headerSize;
+    u32 nImages;
+    u32 pixelsPerImg;
+    u32 nClasses;
+    u32 width;
+    u32 height;
+    u64 sourceImagesSize;
+    u64 sourceLabelsSize;
+    u64 sourceImagesModifiedTime;
+    u64 sourceLabelsModifiedTime;
+    u64 fileSize;
+    u64 checksum;
+    u64 sectionOffsets[DATASET_SECTION_COUNT];
+    u64 sectionSizes[DATASET_SECTION_COUNT];
+};
+
+#define AlignUp(value, alignment) (((value) + (alignment) - 1) & ~((u64)(alignment) - 1))
+
+// NOTE(heyyod): 64 bit FNV-1a over 8 byte words with an extra shift to mix the high bits.
+// It only has to catch truncated or corrupted files and it is fast enough to check on
+// every load. size has to be a multiple of 8 so that hashing section by section gives
+// the same result as hashing the whole file.
+func u64
+DatasetChecksum(u64 hash, u8 *data, u64 size)
+{
+    Assert(size % 8 == 0);
+    for (u64 i = 0; i < size; i += 8)
+    {
+        u64 word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+#define DATASET_CHECKSUM_SEED 0xCBF29CE484222325ULL
+
+// NOTE(heyyod): DatasetChecksum of any size, the last bytes are zero padded to 8
+func u64
+PaddedChecksum(u64 hash, u8 *data, u64 size)
+{
+    u64 wholeSize = size & ~7ull;
+    hash = DatasetChecksum(hash, data, wholeSize);
+    u8 tail[8] = {};
+    memcpy(tail, data + wholeSize, size - wholeSize);
+    return DatasetChecksum(hash, tail, sizeof(tail));
+}
+
+// NOTE(heyyod): Identifies the images and labels of a data set, the same whether they were
+// read from the idx files or from a cache
+func u64
+ImageDataChecksum(image_data &data)
+{
+    u32 shape[2] = {data.nImages, data.pixelsPerImg};
+    u64 checksum = DatasetChecksum(DATASET_CHECKSUM_SEED, (u8 *)shape, sizeof(shape));
+    checksum = PaddedChecksum(checksum, data.pixels, (u64)data.nImages * data.pixelsPerImg);
+    return PaddedChecksum(checksum, data.labels, data.nImages);
+}
+
+// NOTE(heyyod): Writes one section at the current (aligned) position and pads it
+func bool
+WriteCacheSection(FILE *file, dataset_cache_header &header, u32 section, void *data, u64 size, u64 &checksum)
+{
+    local_var u8 zeros[DATASET_CACHE_ALIGNMENT] = {};
+    u64 offset = FileTell(file);
+    Assert(offset % DATASET_CACHE_ALIGNMENT == 0);
+    header.sectionOffsets[section] = offset;
+    header.sectionSizes[section] = size;
+
+    u64 padding = AlignUp(size, DATASET_CACHE_ALIGNMENT) - size;
+    if (fwrite(data, 1, size, file) != size || fwrite(zeros, 1, padding, file) != padding)
+        return false;
+
+    // NOTE(heyyod): Hash the whole 8 byte words and the tail with its padding separately
+    u64 wholeSize = size & ~7ull;
+    checksum = DatasetChecksum(checksum, (u8 *)data, wholeSize);
+    u8 tail[DATASET_CACHE_ALIGNMENT + 8] = {};
+    memcpy(tail, (u8 *)data + wholeSize, size - wholeSize);
+    checksum = DatasetChecksum(checksum, tail, (size - wholeSize) + padding);
+    return true;
+}
+
+func bool
+WriteDatasetCache(image_data &data, char *cachePath, char *imagesFilepath, char *labelsFilepath)
+{
+    // NOTE(heyyod): Other processes may have the old cache mapped, so it is replaced only
+    // once the new one is complete
+    char tempPath[1024];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", cachePath);
+    FILE *file = fopen(tempPath, "wb");
+    if (!file)
+        return false;
+
+    dataset_cache_header header = {};
+    header.magic = DATASET_CACHE_MAGIC;
+    header.version = DATASET_CACHE_VERSION;
+    header.headerSize = sizeof(dataset_cache_header);
+    header.nImages = data.nImages;
+    header.pixelsPerImg = data.pixelsPerImg;
+    header.nClasses = data.nClasses;
+    header.width = data.width;
+    header.height = data.height;
+    header.sourceImagesSize = GetFileSize(imagesFilepath);
+    header.sourceLabelsSize = GetFileSize(labelsFilepath);
+    header.sourceImagesModifiedTime = GetFileModifiedTime(imagesFilepath);
+    header.sourceLabelsModifiedTime = GetFileModifiedTime(labelsFilepath);
+
+    u64 nPixels = (u64)data.nImages * data.pixelsPerImg;
+    f32 *normalizedPixels = (f32 *)malloc(Max(nPixels, 1ull) * sizeof(f32));
+    u32 *l1Norms = (u32 *)malloc(Max(data.nImages, 1u) * sizeof(u32));
+    u32 *squaredNorms = (u32 *)malloc(Max(data.nImages, 1u) * sizeof(u32));
+    u32 *classOffsets = (u32 *)calloc(data.nClasses + 1, sizeof(u32));
+    u32 *classImages = (u32 *)malloc(Max(data.nImages, 1u) * sizeof(u32));
+
+    for (u32 iImg = 0; iImg < data.nImages; iImg++)
+    {
+        u8 *img = &data.pixels[(u64)iImg * data.pixelsPerImg];
+        f32 *normalizedImg = &normalizedPixels[(u64)iImg * data.pixelsPerImg];
+        u32 l1 = 0;
+        u32 l2 = 0;
+        for (u32 iPixel = 0; iPixel < data.pixelsPerImg; iPixel++)
+        {
+            normalizedImg[iPixel] = (f32)img[iPixel] / 255.0f;
+            l1 += img[iPixel];
+            l2 += (u32)img[iPixel] * img[iPixel];
+        }
+        l1Norms[iImg] = l1;
+        squaredNorms[iImg] = l2;
+        classOffsets[data.labels[iImg] + 1]++;
+    }
+
+    // NOTE(heyyod): Counts to offsets, then a stable counting sort of the image indices
+    for (u32 iClass = 0; iClass < data.nClasses; iClass++)
+        classOffsets[iClass + 1] += classOffsets[iClass];
+    u32 *classCursors = (u32 *)malloc(Max(data.nClasses, 1u) * sizeof(u32));
+    memcpy(classCursors, classOffsets, data.nClasses * sizeof(u32));
+    for (u32 iImg = 0; iImg < data.nImages; iImg++)
+        classImages[classCursors[data.labels[iImg]]++] = iImg;
+    free(classCursors);
+
+    // NOTE(heyyod): The header gets written again at the end with the offsets and the checksum
+    u64 checksum = DATASET_CHECKSUM_SEED;
+    u64 headerSpace = AlignUp(sizeof(dataset_cache_header), DATASET_CACHE_ALIGNMENT);
+    u8 headerBytes[AlignUp(sizeof(dataset_cache_header), DATASET_CACHE_ALIGNMENT)] = {};
+    bool success = fwrite(headerBytes, 1, headerSpace, file) == headerSpace &&
+        WriteCacheSection(file, header, DATASET_SECTION_PIXELS, data.pixels, nPixels, checksum) &&
+        WriteCacheSection(file, header, DATASET_SECTION_NORMALIZED_PIXELS, normalizedPixels, nPixels * sizeof(f32), checksum) &&
+        WriteCacheSection(file, header, DATASET_SECTION_L1_NORMS, l1Norms, data.nImages * sizeof(u32), checksum) &&
+        WriteCacheSection(file, header, DATASET_SECTION_SQUARED_NORMS, squaredNorms, data.nImages * sizeof(u32), checksum) &&
+        WriteCacheSection(file, header, DATASET_SECTION_LABELS, data.labels, data.nImages, checksum) &&
+        WriteCacheSection(file, header, DATASET_SECTION_CLASS_OFFSETS, classOffsets, (data.nClasses + 1) * sizeof(u32), checksum) &&
+        WriteCacheSection(file, header, DATASET_SECTION_CLASS_IMAGES, classImages, data.nImages * sizeof(u32), checksum);
+    if (success)
+    {
+        header.fileSize = FileTell(file);
+        header.checksum = checksum;
+        memcpy(headerBytes, &header, sizeof(header));
+        success = fseek(file, 0, SEEK_SET) == 0 && fwrite(headerBytes, 1, headerSpace, file) == headerSpace;
+    }
+    success = (fclose(file) == 0) && success;
+    success = success && MoveFileOver(tempPath, cachePath);
+    if (!success)
+        remove(tempPath);
+
+    free(normalizedPixels);
+    free(l1Norms);
+    free(squaredNorms);
+    free(classOffsets);
+    free(classImages);
+    return success;
+}
+
+// NOTE(heyyod): Maps a cache written by WriteDatasetCache. Every pointer of dataOut points
+// into the mapping. Pass the idx paths to reject a cache of different source files, or 0
+// to skip that check. verifyChecksum reads the whole cache, without it only the header and
+// the section table are checked and the pages are faulted in as they get used.
+func bool
+MapDatasetCache(char *cachePath, image_data &dataOut, char *imagesFilepath = 0, char *labelsFilepath = 0, bool verifyChecksum = false)
+{
+    mapped_file cacheFile;
+    if (!MapFile(cachePath, cacheFile))
+        return false;
+
+    dataset_cache_header header = {};
+    bool valid = cacheFile.size >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, cacheFile.memory, sizeof(header));
+        valid = header.magic == DATASET_CACHE_MAGIC &&
+            header.version == DATASET_CACHE_VERSION &&
+            header.headerSize == sizeof(dataset_cache_header) &&
+            header.fileSize == cacheFile.size &&
+            header.nClasses > 0 && header.nClasses <= MAX_CLASSES;
+    }
+    if (valid && imagesFilepath && labelsFilepath)
+    {
+        valid = header.sourceImagesSize == GetFileSize(imagesFilepath) &&
+            header.sourceLabelsSize == GetFileSize(labelsFilepath) &&
+            header.sourceImagesModifiedTime == GetFileModifiedTime(imagesFilepath) &&
+            header.sourceLabelsModifiedTime == GetFileModifiedTime(labelsFilepath);
+    }
+
+    u64 nPixels = (u64)header.nImages * header.pixelsPerImg;
+    u64 expectedSizes[DATASET_SECTION_COUNT] = {};
+    expectedSizes[DATASET_SECTION_PIXELS] = nPixels;
+    expectedSizes[DATASET_SECTION_NORMALIZED_PIXELS] = nPixels * sizeof(f32);
+    expectedSizes[DATASET_SECTION_L1_NORMS] = (u64)header.nImages * sizeof(u32);
+    expectedSizes[DATASET_SECTION_SQUARED_NORMS] = (u64)header.nImages * sizeof(u32);
+    expectedSizes[DATASET_SECTION_LABELS] = header.nImages;
+    expectedSizes[DATASET_SECTION_CLASS_OFFSETS] = ((u64)header.nClasses + 1) * sizeof(u32);
+    expectedSizes[DATASET_SECTION_CLASS_IMAGES] = (u64)header.nImages * sizeof(u32);
+    for (u32 iSection = 0; valid && iSection < DATASET_SECTION_COUNT; iSection++)
+    {
+        u64 offset = header.sectionOffsets[iSection];
+        u64 size = header.sectionSizes[iSection];
+        valid = size == expectedSizes[iSection] &&
+            offset % DATASET_CACHE_ALIGNMENT == 0 &&
+            offset >= header.headerSize &&
+            offset + AlignUp(size, DATASET_CACHE_ALIGNMENT) <= cacheFile.size;
+    }
+
+    if (valid && verifyChecksum)
+    {
+        u64 headerSpace = AlignUp(sizeof(dataset_cache_header), DATASET_CACHE_ALIGNMENT);
+        u64 checksum = DatasetChecksum(DATASET_CHECKSUM_SEED, cacheFile.memory + headerSpace, cacheFile.size - headerSpace);
+        valid = checksum == header.checksum;
+        if (!valid)
+            Print("Dataset cache " << cachePath << " is corrupted\n");
+    }
+    if (!valid)
+    {
+        UnmapFile(cacheFile);
+        return false;
+    }
+
+    AdviseMapping(cacheFile, MAP_ADVICE_WILLNEED);
+
+    u8 *base = cacheFile.memory;
+    dataOut = {};
+    dataOut.nImages = header.nImages;
+    dataOut.pixelsPerImg = header.pixelsPerImg;
+    dataOut.nClasses = header.nClasses;
+    dataOut.width = header.width;
+    dataOut.height = header.height;
+    dataOut.pixels = base + header.sectionOffsets[DATASET_SECTION_PIXELS];
+    dataOut.labels = base + header.sectionOffsets[DATASET_SECTION_LABELS];
+    dataOut.normalizedPixels = (f32 *)(base + header.sectionOffsets[DATASET_SECTION_NORMALIZED_PIXELS]);
+    dataOut.l1Norms = (u32 *)(base + header.sectionOffsets[DATASET_SECTION_L1_NORMS]);
+    dataOut.squaredNorms = (u32 *)(base + header.sectionOffsets[DATASET_SECTION_SQUARED_NORMS]);
+    dataOut.classOffsets = (u32 *)(base + header.sectionOffsets[DATASET_SECTION_CLASS_OFFSETS]);
+    dataOut.classImages = (u32 *)(base + header.sectionOffsets[DATASET_SECTION_CLASS_IMAGES]);
+    dataOut.cacheMapping = cacheFile;
+    return true;
+}
+
+// NOTE(heyyod): Uses the cache next to the idx files and (re)builds it when it is
+// missing or stale. Falls back to the idx files if the cache can't be written.
+func bool
+LoadDataset(char *imagesFilepath, char *labelsFilepath, char *cachePath, image_data &dataOut)
+{
+    if (MapDatasetCache(cachePath, dataOut, imagesFilepath, labelsFilepath))
+        return true;
+
+    if (!MapData(imagesFilepath, labelsFilepath, dataOut))
+        return false;
+
+    Print("Building dataset cache " << cachePath << "\n");
+    if (!WriteDatasetCache(dataOut, cachePath, imagesFilepath, labelsFilepath))
+        return true;
+
+    image_data cached;
+    if (MapDatasetCache(cachePath, cached, imagesFilepath, labelsFilepath, true))
+    {
+        FreeData(dataOut);
+        dataOut = cached;
+    }
+    return true;
+}
+
+#endif //DATASET_CACHE_H
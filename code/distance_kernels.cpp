@@ -0,0 +1,534 @@
+#include "cpu_features.h"
+
+// NOTE(heyyod): Distance kernels between two u8 images. Every instruction set has its own
+// version and InitDistanceKernels picks the best one the cpu supports at runtime.
+typedef u32 distance_kernel(u8 *a, u8 *b, u32 count);
+
+// NOTE(heyyod): Same as distance_kernel but it checks the running distance against bound
+// after every DISTANCE_ABANDON_BLOCK pixels and stops as soon as it reaches it. The returned
+// value is only exact when it is below bound, which is all the k-nn needs to reject an image.
+// 128 pixels is a few rows of an mnist image and a whole number of registers for every
+// instruction set. The accumulators stay in registers, the check costs one horizontal add.
+#define DISTANCE_ABANDON_BLOCK 128
+typedef u32 bounded_distance_kernel(u8 *a, u8 *b, u32 count, u32 bound);
+
+// NOTE(heyyod): Dot products of one u8 image with 4 images that have already been widened
+// to i16. The 4 images are `stride` elements apart. Loading and widening `a` once for
+// 4 dot products is what makes the batched k-nn compute bound instead of memory bound.
+#define DOT_KERNEL_IMAGES 4
+typedef void dot4_kernel(u8 *a, i16 *b, u32 count, u32 stride, u32 *dotsOut);
+
+struct distance_kernels
+{
+    distance_kernel *l1;
+    distance_kernel *l2Squared;
+    bounded_distance_kernel *l1Bounded;
+    bounded_distance_kernel *l2SquaredBounded;
+    dot4_kernel *dot4;
+    char *name;
+};
+
+global_var distance_kernels distanceKernels;
+
+//-----------------------------------------------------
+//            Scalar
+//-----------------------------------------------------
+func u32
+L1DistanceScalar(u8 *a, u8 *b, u32 count)
+{
+    u32 dist = 0;
+    for (u32 i = 0; i < count; i++)
+        dist += (u32)Abs((i32)a[i] - (i32)b[i]);
+    return dist;
+}
+
+func u32
+L2SquaredDistanceScalar(u8 *a, u8 *b, u32 count)
+{
+    u32 dist = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        i32 diff = (i32)a[i] - (i32)b[i];
+        dist += (u32)(diff * diff);
+    }
+    return dist;
+}
+
+func u32
+L1DistanceBoundedScalar(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    u32 dist = 0;
+    for (u32 i = 0; i < count && dist < bound; i += DISTANCE_ABANDON_BLOCK)
+        dist += L1DistanceScalar(a + i, b + i, Min((u32)DISTANCE_ABANDON_BLOCK, count - i));
+    return dist;
+}
+
+func u32
+L2SquaredDistanceBoundedScalar(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    u32 dist = 0;
+    for (u32 i = 0; i < count && dist < bound; i += DISTANCE_ABANDON_BLOCK)
+        dist += L2SquaredDistanceScalar(a + i, b + i, Min((u32)DISTANCE_ABANDON_BLOCK, count - i));
+    return dist;
+}
+
+func void
+Dot4Scalar(u8 *a, i16 *b, u32 count, u32 stride, u32 *dotsOut)
+{
+    for (u32 j = 0; j < DOT_KERNEL_IMAGES; j++)
+    {
+        i16 *bj = b + j * stride;
+        u32 dot = 0;
+        for (u32 i = 0; i < count; i++)
+            dot += (u32)((i32)a[i] * (i32)bj[i]);
+        dotsOut[j] = dot;
+    }
+}
+
+func void
+Dot4ScalarTail(u8 *a, i16 *b, u32 begin, u32 count, u32 stride, u32 *dotsOut)
+{
+    for (u32 j = 0; j < DOT_KERNEL_IMAGES; j++)
+    {
+        i16 *bj = b + j * stride;
+        for (u32 i = begin; i < count; i++)
+            dotsOut[j] += (u32)((i32)a[i] * (i32)bj[i]);
+    }
+}
+
+//-----------------------------------------------------
+//            SSE4.1
+//-----------------------------------------------------
+// NOTE(heyyod): psadbw sums the absolute differences of 8 byte pairs into a u64,
+// so one instruction does 16 pixels.
+TARGET_SSE41 func u32
+L1DistanceSSE41(u8 *a, u8 *b, u32 count)
+{
+    __m128i sum = _mm_setzero_si128();
+    u32 i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+    }
+    u32 dist = (u32)(_mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1));
+    return dist + L1DistanceScalar(a + i, b + i, count - i);
+}
+
+// NOTE(heyyod): Widen to i16 so the difference can't wrap, then pmaddwd squares
+// and adds pairs of differences into i32 lanes. A pair is at most 2 * 255^2, so
+// a lane can't overflow for any realistic image size.
+TARGET_SSE41 func u32
+L2SquaredDistanceSSE41(u8 *a, u8 *b, u32 count)
+{
+    __m128i sum = _mm_setzero_si128();
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(a + i)));
+        __m128i vb = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(b + i)));
+        __m128i diff = _mm_sub_epi16(va, vb);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(diff, diff));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    u32 dist = (u32)_mm_cvtsi128_si32(sum);
+    return dist + L2SquaredDistanceScalar(a + i, b + i, count - i);
+}
+
+TARGET_SSE41 func u32
+HorizontalAddSSE41(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (u32)_mm_cvtsi128_si32(v);
+}
+
+TARGET_SSE41 func u32
+L1DistanceBoundedSSE41(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    __m128i sum = _mm_setzero_si128();
+    u32 i = 0;
+    while (i + DISTANCE_ABANDON_BLOCK <= count)
+    {
+        for (u32 end = i + DISTANCE_ABANDON_BLOCK; i < end; i += 16)
+        {
+            __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+        }
+        u32 dist = (u32)(_mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1));
+        if (dist >= bound)
+            return dist;
+    }
+    u32 dist = (u32)(_mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1));
+    return dist + L1DistanceSSE41(a + i, b + i, count - i);
+}
+
+TARGET_SSE41 func u32
+L2SquaredDistanceBoundedSSE41(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    __m128i sum = _mm_setzero_si128();
+    u32 i = 0;
+    while (i + DISTANCE_ABANDON_BLOCK <= count)
+    {
+        for (u32 end = i + DISTANCE_ABANDON_BLOCK; i < end; i += 8)
+        {
+            __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(a + i)));
+            __m128i vb = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(b + i)));
+            __m128i diff = _mm_sub_epi16(va, vb);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(diff, diff));
+        }
+        u32 dist = HorizontalAddSSE41(sum);
+        if (dist >= bound)
+            return dist;
+    }
+    return HorizontalAddSSE41(sum) + L2SquaredDistanceSSE41(a + i, b + i, count - i);
+}
+
+TARGET_SSE41 func void
+Dot4SSE41(u8 *a, i16 *b, u32 count, u32 stride, u32 *dotsOut)
+{
+    __m128i sum0 = _mm_setzero_si128();
+    __m128i sum1 = _mm_setzero_si128();
+    __m128i sum2 = _mm_setzero_si128();
+    __m128i sum3 = _mm_setzero_si128();
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(a + i)));
+        sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(va, _mm_loadu_si128((__m128i *)(b + 0 * stride + i))));
+        sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(va, _mm_loadu_si128((__m128i *)(b + 1 * stride + i))));
+        sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(va, _mm_loadu_si128((__m128i *)(b + 2 * stride + i))));
+        sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(va, _mm_loadu_si128((__m128i *)(b + 3 * stride + i))));
+    }
+    dotsOut[0] = HorizontalAddSSE41(sum0);
+    dotsOut[1] = HorizontalAddSSE41(sum1);
+    dotsOut[2] = HorizontalAddSSE41(sum2);
+    dotsOut[3] = HorizontalAddSSE41(sum3);
+    Dot4ScalarTail(a, b, i, count, stride, dotsOut);
+}
+
+//-----------------------------------------------------
+//            AVX2
+//-----------------------------------------------------
+TARGET_AVX2 func u32
+L1DistanceAVX2(u8 *a, u8 *b, u32 count)
+{
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    u32 i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        __m256i va0 = _mm256_loadu_si256((__m256i *)(a + i));
+        __m256i vb0 = _mm256_loadu_si256((__m256i *)(b + i));
+        __m256i va1 = _mm256_loadu_si256((__m256i *)(a + i + 32));
+        __m256i vb1 = _mm256_loadu_si256((__m256i *)(b + i + 32));
+        sum0 = _mm256_add_epi64(sum0, _mm256_sad_epu8(va0, vb0));
+        sum1 = _mm256_add_epi64(sum1, _mm256_sad_epu8(va1, vb1));
+    }
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256((__m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((__m256i *)(b + i));
+        sum0 = _mm256_add_epi64(sum0, _mm256_sad_epu8(va, vb));
+    }
+    __m256i sum256 = _mm256_add_epi64(sum0, sum1);
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+    if (i + 16 <= count)
+    {
+        __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+        i += 16;
+    }
+    u32 dist = (u32)(_mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1));
+    return dist + L1DistanceScalar(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 func u32
+L2SquaredDistanceAVX2(u8 *a, u8 *b, u32 count)
+{
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    u32 i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i va0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(a + i)));
+        __m256i vb0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(b + i)));
+        __m256i va1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(a + i + 16)));
+        __m256i vb1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(b + i + 16)));
+        __m256i diff0 = _mm256_sub_epi16(va0, vb0);
+        __m256i diff1 = _mm256_sub_epi16(va1, vb1);
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(diff0, diff0));
+        sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(diff1, diff1));
+    }
+    if (i + 16 <= count)
+    {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(b + i)));
+        __m256i diff = _mm256_sub_epi16(va, vb);
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(diff, diff));
+        i += 16;
+    }
+    __m256i sum256 = _mm256_add_epi32(sum0, sum1);
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    u32 dist = (u32)_mm_cvtsi128_si32(sum);
+    return dist + L2SquaredDistanceScalar(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 func u32
+HorizontalAddAVX2(__m256i v)
+{
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (u32)_mm_cvtsi128_si32(sum);
+}
+
+TARGET_AVX2 func u32
+L1DistanceBoundedAVX2(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    __m256i sum = _mm256_setzero_si256();
+    u32 i = 0;
+    while (i + DISTANCE_ABANDON_BLOCK <= count)
+    {
+        for (u32 end = i + DISTANCE_ABANDON_BLOCK; i < end; i += 32)
+        {
+            __m256i va = _mm256_loadu_si256((__m256i *)(a + i));
+            __m256i vb = _mm256_loadu_si256((__m256i *)(b + i));
+            sum = _mm256_add_epi64(sum, _mm256_sad_epu8(va, vb));
+        }
+        // NOTE(heyyod): The u64 lanes hold small sums, so adding them as u32 is fine
+        u32 dist = HorizontalAddAVX2(sum);
+        if (dist >= bound)
+            return dist;
+    }
+    return HorizontalAddAVX2(sum) + L1DistanceAVX2(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 func u32
+L2SquaredDistanceBoundedAVX2(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    __m256i sum = _mm256_setzero_si256();
+    u32 i = 0;
+    while (i + DISTANCE_ABANDON_BLOCK <= count)
+    {
+        for (u32 end = i + DISTANCE_ABANDON_BLOCK; i < end; i += 16)
+        {
+            __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(a + i)));
+            __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(b + i)));
+            __m256i diff = _mm256_sub_epi16(va, vb);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(diff, diff));
+        }
+        u32 dist = HorizontalAddAVX2(sum);
+        if (dist >= bound)
+            return dist;
+    }
+    return HorizontalAddAVX2(sum) + L2SquaredDistanceAVX2(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 func void
+Dot4AVX2(u8 *a, i16 *b, u32 count, u32 stride, u32 *dotsOut)
+{
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    __m256i sum2 = _mm256_setzero_si256();
+    __m256i sum3 = _mm256_setzero_si256();
+    u32 i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(a + i)));
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(va, _mm256_loadu_si256((__m256i *)(b + 0 * stride + i))));
+        sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(va, _mm256_loadu_si256((__m256i *)(b + 1 * stride + i))));
+        sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(va, _mm256_loadu_si256((__m256i *)(b + 2 * stride + i))));
+        sum3 = _mm256_add_epi32(sum3, _mm256_madd_epi16(va, _mm256_loadu_si256((__m256i *)(b + 3 * stride + i))));
+    }
+    dotsOut[0] = HorizontalAddAVX2(sum0);
+    dotsOut[1] = HorizontalAddAVX2(sum1);
+    dotsOut[2] = HorizontalAddAVX2(sum2);
+    dotsOut[3] = HorizontalAddAVX2(sum3);
+    Dot4ScalarTail(a, b, i, count, stride, dotsOut);
+}
+
+//-----------------------------------------------------
+//            AVX-512BW
+//-----------------------------------------------------
+// NOTE(heyyod): By hand instead of _mm512_reduce_add_*. In gcc 12 those, the unmasked
+// extracts and even the 512 -> 256 casts pass an undefined register to the builtin and
+// warn with -Wall. A zero masked extract of every lane compiles to the same instruction.
+TARGET_AVX512BW func u32
+HorizontalAddAVX512(__m512i v)
+{
+    __m256i sum256 = _mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xFF, v, 0), _mm512_maskz_extracti64x4_epi64(0xFF, v, 1));
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (u32)_mm_cvtsi128_si32(sum);
+}
+
+TARGET_AVX512BW func u64
+HorizontalAdd64AVX512(__m512i v)
+{
+    __m256i sum256 = _mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0xFF, v, 0), _mm512_maskz_extracti64x4_epi64(0xFF, v, 1));
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    return (u64)_mm_cvtsi128_si64(sum);
+}
+
+// NOTE(heyyod): The tail is done with a masked load so there is no scalar loop.
+TARGET_AVX512BW func u32
+L1DistanceAVX512(u8 *a, u8 *b, u32 count)
+{
+    __m512i sum = _mm512_setzero_si512();
+    u32 i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        __m512i va = _mm512_loadu_si512((void *)(a + i));
+        __m512i vb = _mm512_loadu_si512((void *)(b + i));
+        sum = _mm512_add_epi64(sum, _mm512_sad_epu8(va, vb));
+    }
+    if (i < count)
+    {
+        __mmask64 mask = (1ULL << (count - i)) - 1;
+        __m512i va = _mm512_maskz_loadu_epi8(mask, a + i);
+        __m512i vb = _mm512_maskz_loadu_epi8(mask, b + i);
+        sum = _mm512_add_epi64(sum, _mm512_sad_epu8(va, vb));
+    }
+    return (u32)HorizontalAdd64AVX512(sum);
+}
+
+TARGET_AVX512BW func u32
+L2SquaredDistanceAVX512(u8 *a, u8 *b, u32 count)
+{
+    __m512i sum = _mm512_setzero_si512();
+    u32 i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m512i va = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *)(a + i)));
+        __m512i vb = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *)(b + i)));
+        __m512i diff = _mm512_sub_epi16(va, vb);
+        sum = _mm512_add_epi32(sum, _mm512_madd_epi16(diff, diff));
+    }
+    if (i < count)
+    {
+        __mmask64 mask = (1ULL << (count - i)) - 1;
+        __m512i va = _mm512_cvtepu8_epi16(_mm512_maskz_extracti64x4_epi64(0xFF, _mm512_maskz_loadu_epi8(mask, a + i), 0));
+        __m512i vb = _mm512_cvtepu8_epi16(_mm512_maskz_extracti64x4_epi64(0xFF, _mm512_maskz_loadu_epi8(mask, b + i), 0));
+        __m512i diff = _mm512_sub_epi16(va, vb);
+        sum = _mm512_add_epi32(sum, _mm512_madd_epi16(diff, diff));
+    }
+    return HorizontalAddAVX512(sum);
+}
+
+TARGET_AVX512BW func u32
+L1DistanceBoundedAVX512(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    __m512i sum = _mm512_setzero_si512();
+    u32 i = 0;
+    while (i + DISTANCE_ABANDON_BLOCK <= count)
+    {
+        for (u32 end = i + DISTANCE_ABANDON_BLOCK; i < end; i += 64)
+        {
+            __m512i va = _mm512_loadu_si512((void *)(a + i));
+            __m512i vb = _mm512_loadu_si512((void *)(b + i));
+            sum = _mm512_add_epi64(sum, _mm512_sad_epu8(va, vb));
+        }
+        u32 dist = (u32)HorizontalAdd64AVX512(sum);
+        if (dist >= bound)
+            return dist;
+    }
+    return (u32)HorizontalAdd64AVX512(sum) + L1DistanceAVX512(a + i, b + i, count - i);
+}
+
+TARGET_AVX512BW func u32
+L2SquaredDistanceBoundedAVX512(u8 *a, u8 *b, u32 count, u32 bound)
+{
+    __m512i sum = _mm512_setzero_si512();
+    u32 i = 0;
+    while (i + DISTANCE_ABANDON_BLOCK <= count)
+    {
+        for (u32 end = i + DISTANCE_ABANDON_BLOCK; i < end; i += 32)
+        {
+            __m512i va = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *)(a + i)));
+            __m512i vb = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *)(b + i)));
+            __m512i diff = _mm512_sub_epi16(va, vb);
+            sum = _mm512_add_epi32(sum, _mm512_madd_epi16(diff, diff));
+        }
+        u32 dist = HorizontalAddAVX512(sum);
+        if (dist >= bound)
+            return dist;
+    }
+    return HorizontalAddAVX512(sum) + L2SquaredDistanceAVX512(a + i, b + i, count - i);
+}
+
+TARGET_AVX512BW func void
+Dot4AVX512(u8 *a, i16 *b, u32 count, u32 stride, u32 *dotsOut)
+{
+    __m512i sum0 = _mm512_setzero_si512();
+    __m512i sum1 = _mm512_setzero_si512();
+    __m512i sum2 = _mm512_setzero_si512();
+    __m512i sum3 = _mm512_setzero_si512();
+    u32 i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m512i va = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *)(a + i)));
+        sum0 = _mm512_add_epi32(sum0, _mm512_madd_epi16(va, _mm512_loadu_si512((void *)(b + 0 * stride + i))));
+        sum1 = _mm512_add_epi32(sum1, _mm512_madd_epi16(va, _mm512_loadu_si512((void *)(b + 1 * stride + i))));
+        sum2 = _mm512_add_epi32(sum2, _mm512_madd_epi16(va, _mm512_loadu_si512((void *)(b + 2 * stride + i))));
+        sum3 = _mm512_add_epi32(sum3, _mm512_madd_epi16(va, _mm512_loadu_si512((void *)(b + 3 * stride + i))));
+    }
+    dotsOut[0] = HorizontalAddAVX512(sum0);
+    dotsOut[1] = HorizontalAddAVX512(sum1);
+    dotsOut[2] = HorizontalAddAVX512(sum2);
+    dotsOut[3] = HorizontalAddAVX512(sum3);
+    Dot4ScalarTail(a, b, i, count, stride, dotsOut);
+}
+
+func void
+InitDistanceKernels()
+{
+    if (distanceKernels.l1)
+        return;
+
+    cpu_features features = GetCpuFeatures();
+    if (features.avx512bw)
+    {
+        distanceKernels.l1 = L1DistanceAVX512;
+        distanceKernels.l2Squared = L2SquaredDistanceAVX512;
+        distanceKernels.l1Bounded = L1DistanceBoundedAVX512;
+        distanceKernels.l2SquaredBounded = L2SquaredDistanceBoundedAVX512;
+        distanceKernels.dot4 = Dot4AVX512;
+        distanceKernels.name = "AVX-512BW";
+    }
+    else if (features.avx2)
+    {
+        distanceKernels.l1 = L1DistanceAVX2;
+        distanceKernels.l2Squared = L2SquaredDistanceAVX2;
+        distanceKernels.l1Bounded = L1DistanceBoundedAVX2;
+        distanceKernels.l2SquaredBounded = L2SquaredDistanceBoundedAVX2;
+        distanceKernels.dot4 = Dot4AVX2;
+        distanceKernels.name = "AVX2";
+    }
+    else if (features.sse41)
+    {
+        distanceKernels.l1 = L1DistanceSSE41;
+        distanceKernels.l2Squared = L2SquaredDistanceSSE41;
+        distanceKernels.l1Bounded = L1DistanceBoundedSSE41;
+        distanceKernels.l2SquaredBounded = L2SquaredDistanceBoundedSSE41;
+        distanceKernels.dot4 = Dot4SSE41;
+        distanceKernels.name = "SSE4.1";
+    }
+    else
+    {
+        distanceKernels.l1 = L1DistanceScalar;
+        distanceKernels.l2Squared = L2SquaredDistanceScalar;
+        distanceKernels.l1Bounded = L1DistanceBoundedScalar;
+        distanceKernels.l2SquaredBounded = L2SquaredDistanceBoundedScalar;
+        distanceKernels.dot4 = Dot4Scalar;
+        distanceKernels.name = "Scalar";
+    }
+}
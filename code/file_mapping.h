@@ -0,0 +1,185 @@
+/* date = October 17th 2026 9:30 pm */
+
+#ifndef FILE_MAPPING_H
+#define FILE_MAPPING_H
+
+// NOTE(heyyod): Read only mapping of a whole file. The pages come straight from the os
+// page cache, so several processes mapping the same dataset share one copy of it and
+// nothing is read from disk until it is touched.
+#include <stdio.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+struct mapped_file
+{
+    u8 *memory;
+    u64 size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+enum map_advice
+{
+    MAP_ADVICE_NORMAL,
+    MAP_ADVICE_SEQUENTIAL, // read ahead aggressively, pages can be dropped after use
+    MAP_ADVICE_RANDOM,     // no read ahead
+    MAP_ADVICE_WILLNEED,   // start reading the range in now
+};
+
+func bool
+MapFile(char *filepath, mapped_file &fileOut)
+{
+    fileOut = {};
+#ifdef _WIN32
+    fileOut.file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (fileOut.file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileOut.file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(fileOut.file);
+        return false;
+    }
+    fileOut.size = (u64)fileSize.QuadPart;
+
+    fileOut.mapping = CreateFileMappingA(fileOut.file, 0, PAGE_READONLY, 0, 0, 0);
+    if (!fileOut.mapping)
+    {
+        CloseHandle(fileOut.file);
+        return false;
+    }
+    fileOut.memory = (u8 *)MapViewOfFile(fileOut.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!fileOut.memory)
+    {
+        CloseHandle(fileOut.mapping);
+        CloseHandle(fileOut.file);
+        return false;
+    }
+#else
+    fileOut.fd = open(filepath, O_RDONLY);
+    if (fileOut.fd < 0)
+        return false;
+
+    struct stat fileStat;
+    if (fstat(fileOut.fd, &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        close(fileOut.fd);
+        return false;
+    }
+    fileOut.size = (u64)fileStat.st_size;
+
+    void *memory = mmap(0, fileOut.size, PROT_READ, MAP_SHARED, fileOut.fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        close(fileOut.fd);
+        return false;
+    }
+    fileOut.memory = (u8 *)memory;
+#endif
+    return true;
+}
+
+func void
+UnmapFile(mapped_file &file)
+{
+    if (!file.memory)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(file.memory);
+    CloseHandle(file.mapping);
+    CloseHandle(file.file);
+#else
+    munmap(file.memory, file.size);
+    close(file.fd);
+#endif
+    file = {};
+}
+
+// NOTE(heyyod): Only a hint, the mapping works the same without it.
+// Windows has no equivalent we can rely on, so it is a no-op there.
+func void
+AdviseMapping(mapped_file &file, map_advice advice)
+{
+#ifndef _WIN32
+    int flags = MADV_NORMAL;
+    switch (advice)
+    {
+        case MAP_ADVICE_NORMAL: flags = MADV_NORMAL; break;
+        case MAP_ADVICE_SEQUENTIAL: flags = MADV_SEQUENTIAL; break;
+        case MAP_ADVICE_RANDOM: flags = MADV_RANDOM; break;
+        case MAP_ADVICE_WILLNEED: flags = MADV_WILLNEED; break;
+    }
+    if (file.memory)
+        madvise(file.memory, file.size, flags);
+#endif
+}
+
+// NOTE(heyyod): long is 32 bits on windows, these work past 2GB everywhere
+func u64
+GetFileSize(char *filepath)
+{
+#ifdef _WIN32
+    struct __stat64 fileStat;
+    if (_stat64(filepath, &fileStat) != 0)
+        return 0;
+#else
+    struct stat fileStat;
+    if (stat(filepath, &fileStat) != 0)
+        return 0;
+#endif
+    return (u64)fileStat.st_size;
+}
+
+// NOTE(heyyod): Nanoseconds since the epoch, windows only has whole seconds. 0 when the file
+// doesn't exist.
+func u64
+GetFileModifiedTime(char *filepath)
+{
+#ifdef _WIN32
+    struct __stat64 fileStat;
+    if (_stat64(filepath, &fileStat) != 0)
+        return 0;
+    return (u64)fileStat.st_mtime * 1000000000ull;
+#else
+    struct stat fileStat;
+    if (stat(filepath, &fileStat) != 0)
+        return 0;
+    return (u64)fileStat.st_mtim.tv_sec * 1000000000ull + (u64)fileStat.st_mtim.tv_nsec;
+#endif
+}
+
+func u64
+FileTell(FILE *file)
+{
+#ifdef _WIN32
+    return (u64)_ftelli64(file);
+#else
+    return (u64)ftello(file);
+#endif
+}
+
+// NOTE(heyyod): Atomically replaces dstPath with srcPath. Files that get mapped are written
+// to a temporary file and moved over the old one, so a process that has the old file mapped
+// keeps its copy instead of seeing it truncated under it.
+func bool
+MoveFileOver(char *srcPath, char *dstPath)
+{
+#ifdef _WIN32
+    return MoveFileExA(srcPath, dstPath, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(srcPath, dstPath) == 0;
+#endif
+}
+
+#endif //FILE_MAPPING_H
@@ -0,0 +1,140 @@
+/* date = October 17th 2026 11:40 pm */
+
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#include <iomanip>
+
+// NOTE(heyyod): SET TO 1 FOR THE TIMESTAMP QUERIES AND THE REPORT
+#define GPU_PROFILING 0
+
+// NOTE(heyyod): Durations go into log scale buckets, PROFILE_SUB_BUCKETS per power of two
+// of nanoseconds, so the percentiles are within ~12% and the memory is fixed.
+#define PROFILE_SUB_BUCKETS 8
+#define PROFILE_SUB_BUCKET_BITS 3
+#define PROFILE_BUCKETS (40 * PROFILE_SUB_BUCKETS)
+
+enum profile_timer
+{
+    PROFILE_KNN_DISTANCES,  // gpu time of the knn distance dispatch
+    PROFILE_KNN_TOP_K,      // gpu time of the two top-k dispatches
+    PROFILE_FEED_FORWARD,   // gpu time of every layer for a batch
+    PROFILE_BACK_PROPAGATE, // gpu time of every layer for a batch
+    PROFILE_SUBMIT,         // host time spent recording and in vkQueueSubmit
+    PROFILE_ROUND_TRIP,     // host time from the submit until the fence is seen signaled
+
+    PROFILE_TIMER_COUNT
+};
+
+global_var char *profileTimerNames[PROFILE_TIMER_COUNT] = {
+    "knn distances", "knn top-k", "feed forward", "back propagate", "submit (host)", "round trip (host)",
+};
+
+struct profile_histogram
+{
+    u64 count;
+    f64 totalNs;
+    u32 buckets[PROFILE_BUCKETS];
+};
+
+global_var profile_histogram profileHistograms[PROFILE_TIMER_COUNT];
+
+func u32
+ProfileBucket(u64 ns)
+{
+    if (ns < PROFILE_SUB_BUCKETS)
+        return (u32)ns;
+
+    u32 octave = 0;
+    while ((ns >> octave) > 1)
+        octave++;
+    u32 sub = (u32)(ns >> (octave - PROFILE_SUB_BUCKET_BITS)) & (PROFILE_SUB_BUCKETS - 1);
+    u32 bucket = (octave - PROFILE_SUB_BUCKET_BITS + 1) * PROFILE_SUB_BUCKETS + sub;
+    return Min(bucket, (u32)PROFILE_BUCKETS - 1);
+}
+
+// NOTE(heyyod): Middle of the bucket's range
+func f64
+ProfileBucketValue(u32 bucket)
+{
+    if (bucket < PROFILE_SUB_BUCKETS)
+        return (f64)bucket;
+
+    u32 octave = bucket / PROFILE_SUB_BUCKETS + PROFILE_SUB_BUCKET_BITS - 1;
+    u32 sub = bucket % PROFILE_SUB_BUCKETS;
+    f64 width = (f64)(1ull << (octave - PROFILE_SUB_BUCKET_BITS));
+    return (PROFILE_SUB_BUCKETS + sub) * width + 0.5 * width;
+}
+
+func void
+ProfileRecord(profile_timer timer, u64 ns)
+{
+    profile_histogram &histogram = profileHistograms[timer];
+    histogram.count++;
+    histogram.totalNs += (f64)ns;
+    histogram.buckets[ProfileBucket(ns)]++;
+}
+
+func u64
+NsSince(std::chrono::steady_clock::time_point start)
+{
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(Now() - start).count();
+}
+
+func f64
+ProfilePercentile(profile_histogram &histogram, f64 percentile)
+{
+    u64 target = (u64)(percentile * (f64)histogram.count);
+    u64 seen = 0;
+    for (u32 i = 0; i < PROFILE_BUCKETS; i++)
+    {
+        seen += histogram.buckets[i];
+        if (seen > target)
+            return ProfileBucketValue(i);
+    }
+    return ProfileBucketValue(PROFILE_BUCKETS - 1);
+}
+
+func void
+ResetProfile()
+{
+    for (u32 i = 0; i < PROFILE_TIMER_COUNT; i++)
+        profileHistograms[i] = {};
+}
+
+func void
+PrintProfileReport()
+{
+    Print("\n---- GPU Profile ----\n");
+    Print(std::left << std::setw(20) << "" << std::right << std::setw(11) << "count" << std::setw(13) << "mean (us)" <<
+          std::setw(13) << "p50 (us)" << std::setw(13) << "p99 (us)" << '\n');
+    Print(std::fixed << std::setprecision(2));
+
+    f64 gpuNs = 0;
+    for (u32 i = 0; i < PROFILE_TIMER_COUNT; i++)
+    {
+        profile_histogram &histogram = profileHistograms[i];
+        if (histogram.count == 0)
+            continue;
+        if (i < PROFILE_SUBMIT)
+            gpuNs += histogram.totalNs;
+
+        Print(std::left << std::setw(20) << profileTimerNames[i] << std::right <<
+              std::setw(11) << histogram.count <<
+              std::setw(13) << histogram.totalNs / histogram.count / 1000.0 <<
+              std::setw(13) << ProfilePercentile(histogram, 0.5) / 1000.0 <<
+              std::setw(13) << ProfilePercentile(histogram, 0.99) / 1000.0 << '\n');
+    }
+
+    // NOTE(heyyod): Whatever the gpu wasn't executing our kernels for is recording, submission,
+    // driver and synchronization cost
+    f64 roundTripNs = profileHistograms[PROFILE_ROUND_TRIP].totalNs;
+    if (roundTripNs > 0)
+    {
+        Print(std::setprecision(3) << "gpu execution: " << gpuNs * 1e-9 << " s, round trips: " << roundTripNs * 1e-9 <<
+              " s, overhead: " << std::setprecision(1) << 100.0 * Max(0.0, roundTripNs - gpuNs) / roundTripNs << "%\n");
+    }
+    Print(std::defaultfloat << std::setprecision(6));
+}
+
+#endif //GPU_PROFILER_H
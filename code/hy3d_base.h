@@ -16,6 +16,7 @@ typedef float     f32;
 typedef double    f64;
 
 #define U32_MAX 0xFFFFFFFF
+#define U64_MAX 0xFFFFFFFFFFFFFFFFull
 #define F32_MAX_HEX 0xFFFF7F7F
 #define F32_MAX_EXP 3.4028235e+38
 
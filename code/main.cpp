@@ -3,9 +3,12 @@
 #include <iostream>
 
 #include "data.h"
+#include "dataset_cache.h"
+#include "thread_pool.h"
 #include "vulkan_platform.cpp"
 #include "nearest.cpp"
 #include "neural_net.cpp"
+#include "nn_inference.cpp"
 
 // NOTE(heyyod): SET TO 1 TO PRINT INFO WHILE THE ALGORITHMS RUN (MUCH SLOWER!)
 #define PRINT_ENABLED 0
@@ -14,32 +17,79 @@ int main()
 {
     image_data trainData = {};
     image_data testData = {};
-    if (!ReadData("../data/train-images.idx3-ubyte", "../data/train-labels.idx1-ubyte", trainData))
+    if (!LoadDataset("../data/train-images.idx3-ubyte", "../data/train-labels.idx1-ubyte", "../data/train.cache", trainData))
         return false;
-    if (!ReadData("../data/t10k-images.idx3-ubyte", "../data/t10k-labels.idx1-ubyte", testData))
+    if (!LoadDataset("../data/t10k-images.idx3-ubyte", "../data/t10k-labels.idx1-ubyte", "../data/t10k.cache", testData))
         return false;
     
     bool vulkanEnabled = false;
     if (Vulkan::Initialize())
     {
         vulkanEnabled = true;
-        
         Print("---- Hardware Acceleration With Vulkan Enabled ----\n");
-        
-        neural_net net = {};
-        u32 layerDims[] = {PIXELS_PER_IMAGE, 32, 32, NUM_CLASSES};
-        if (CreateNeuralNet(layerDims, ArrayCount(layerDims), net, trainData, testData))
+    }
+    else
+        Print("---- Hardware Acceleration With Vulkan Not Supported ----\n");
+    
+    // NOTE(heyyod): The neural net runs on the cpu when there is no gpu
+    neural_net net = {};
+    u32 layerDims[] = {trainData.pixelsPerImg, 32, 32, trainData.nClasses};
+    nn_backend backend = vulkanEnabled ? NN_BACKEND_GPU : NN_BACKEND_CPU;
+    if (CreateNeuralNet(layerDims, ArrayCount(layerDims), net, trainData, testData, backend))
+    {
+        nn_train_options trainOptions = {};
+        trainOptions.learningRate = 0.01f;
+        trainOptions.batchSize = 16;
+        trainOptions.nEpochs = 10;
+        trainOptions.validationSplit = 0.1f;
+        trainOptions.patience = 2;
+        if (LoadNeuralNet(net, NN_MODEL_FILEPATH))
+            Print("Loaded the trained model from " << NN_MODEL_FILEPATH << '\n');
+        else
         {
-            TrainNeuralNet(net, trainData, 0.01);
-            TestNeuralNet(net, testData, NUM_TEST_IMAGES);
+            TrainNeuralNet(net, trainData, trainOptions);
+            if (!SaveNeuralNet(net, NN_MODEL_FILEPATH))
+                Print("Couldn't save the model to " << NN_MODEL_FILEPATH << '\n');
         }
-        
+        TestNeuralNet(net, testData, testData.nImages);
     }
+    FreeNeuralNet(net);
+    
+    // NOTE(heyyod): The inference engine only needs the saved model, not the training state
+    nn_inference_engine engine;
+    if (CreateInferenceEngine(NN_MODEL_FILEPATH, engine))
+    {
+        TestInferenceEngine(engine, testData);
+        DestroyInferenceEngine(engine);
+    }
+    
+    pixel_order pixelOrder = {};
+    if (vulkanEnabled)
+        KNearestNeighbour(3, 1, trainData, testData, vulkanEnabled);
     else
     {
-        Print("---- Hardware Acceleration With Vulkan Not Supported ----\n");
+        // NOTE(heyyod): The cpu k-nn works on the pixels ordered by their variance
+        // over the training set, with the constant ones dropped
+        ComputePixelOrder(trainData, pixelOrder);
+        OrderPixels(pixelOrder, trainData);
+        OrderPixels(pixelOrder, testData);
+        
+        KNearestNeighbour(3, 1, trainData, testData, vulkanEnabled);
     }
     
+    // NOTE(heyyod): The datasets point to the order, so they go first
+    FreeData(trainData);
+    FreeData(testData);
+    FreePixelOrder(pixelOrder);
+    
+#if GPU_PROFILING
+    if (vulkanEnabled)
+        PrintProfileReport();
+#endif
+    
+    Vulkan::Destroy();
+    DestroyThreadPool();
+    
     Print("\nFinished. Enter any character and press Enter to exit.");
     u8 stop;
     std::cin >> stop;
@@ -1,147 +1,498 @@
 #include "data.h"
+#include "distance_kernels.cpp"
+#include "top_k.h"
 
 
 /* NOTE(heyyod): 
 MANHATATTAN DISTANCE -> distP = 1
-EUCLIDIAN DISTANCE   -> distP = 2
+EUCLIDIAN DISTANCE   -> distP = 2 (squared, the ordering of the neighbours is the same)
 CHEBYCHEV DISTANCE   -> distP = inf
 */
-func f32
-KNearestNeighbour(u32 nNeighbours, f32 distP, image_data &trainData, image_data &testData, bool vulkanEnabled, u32 nTest = 0)
+
+template <top_k_policy Policy> func u32
+ClassifyNeighbours(top_k<Policy> &neighbours)
 {
-    std::cout << std::endl << nNeighbours << " Nearest Neighbours Algorithm" << std::endl;
+    // NOTE(heyyod): calculate label weights (inverse of distance)
+    // so that the nearest neighbours have greater weights
+    f32 labelWeights[MAX_CLASSES] = {};
+    u32 classifyLabel = 0;
+    for (u32 iNeighbour = 0; iNeighbour < neighbours.count; iNeighbour++)
+    {
+        u32 label = neighbours.ids[iNeighbour];
+        if (neighbours.dists[iNeighbour] > 0)
+            labelWeights[label] += 1.0f / neighbours.dists[iNeighbour];
+        else
+            Assert(0);
+        
+        if (labelWeights[classifyLabel] < labelWeights[label])
+            classifyLabel = label;
+    }
+    return classifyLabel;
+}
+
+// NOTE(heyyod): calculate the distance using the minkowski distance formula
+func u32
+MinkowskiDistance(u8 *a, u8 *b, u32 nPixels, f32 distP)
+{
+    u32 dist = 0;
+    for (u32 iPixel = 0; iPixel < nPixels; iPixel++)
+    {
+        f32 pixelDiff = (f32)Abs((i32)a[iPixel] - (i32)b[iPixel]);
+        dist += (u32)powf(pixelDiff, distP); 
+    }
+    return dist;
+}
+
+// NOTE(heyyod): Shared state of the multithreaded cpu k-nn. Every thread owns
+// listsPerThread neighbour lists (starting at threadIndex * listsPerThread)
+// so there is no locking in the hot loop.
+template <top_k_policy Policy>
+struct knn_cpu_job
+{
+    image_data *trainData;
+    image_data *testData;
+    f32 distP;
+    distance_kernel *distanceKernel; // 0 -> generic minkowski distance
+    bounded_distance_kernel *boundedKernel; // 0 -> no early abandon
+    top_k<Policy> *threadNeighbours;
+    u32 listsPerThread;
+    u8 *classifiedLabels;
+    u32 iTest; // only used when we split the training set
+    u32 *testOffsets; // distance of the dropped pixels per test image, 0 -> raw layout
     
-    if (nTest == 0)
-        nTest = testData.nImages;
+    // NOTE(heyyod): Only used by the batched euclidean mode
+    u32 *trainNorms;
+    i16 *threadWideTests; // KNN_QUERY_BLOCK widened test images per thread
+    u32 wideStride;
+};
+
+// NOTE(heyyod): bound is the distance of the current k-th neighbour. With early abandon
+// the kernel stops once the distance reaches it, since that image can't get in the list
+// anyway. The neighbours we end up with are exactly the same.
+// On the raw row-major layout about half the pixels still get summed on average, and
+// with the AVX-512 kernels the loop is bound by memory, so the extra checks and
+// mispredicted branches cost more than they save. It is only used on the variance ordered
+// layout (see pixel_order), where the informative pixels come first.
+#define KNN_EARLY_ABANDON 1
+
+// NOTE(heyyod): The dropped pixels of the ordered layout have the same value in every training
+// image, so their share of the distance only depends on the test image.
+func u32
+DroppedPixelsDistance(pixel_order &order, u8 *testImg, f32 distP)
+{
+    u32 dist = 0;
+    u32 nDropped = order.nPixels - order.nKept;
+    for (u32 i = 0; i < nDropped; i++)
+    {
+        u32 pixelDiff = (u32)Abs((i32)testImg[order.order[order.nKept + i]] - (i32)order.constants[i]);
+        if (distP == 1.0f)
+            dist += pixelDiff;
+        else if (distP == 2.0f)
+            dist += pixelDiff * pixelDiff;
+        else
+            dist += (u32)powf((f32)pixelDiff, distP);
+    }
+    return dist;
+}
+
+template <top_k_policy Policy> inline u32
+KnnDistance(knn_cpu_job<Policy> &job, u8 *trainImg, u8 *testImg, u32 nPixels, u32 bound)
+{
+    if (job.boundedKernel)
+        return job.boundedKernel(trainImg, testImg, nPixels, bound);
+    if (job.distanceKernel)
+        return job.distanceKernel(trainImg, testImg, nPixels);
+    return MinkowskiDistance(trainImg, testImg, nPixels, job.distP);
+}
+
+// NOTE(heyyod): Every chunk is a range of test images. Each thread does the full
+// scan of the training set for its test images.
+template <top_k_policy Policy> func void
+KnnTestRangeWork(void *data, u32 begin, u32 end, u32 threadIndex)
+{
+    knn_cpu_job<Policy> &job = *(knn_cpu_job<Policy> *)data;
+    image_data &trainData = *job.trainData;
+    image_data &testData = *job.testData;
+    top_k<Policy> &neighbours = job.threadNeighbours[threadIndex * job.listsPerThread];
     
-    Print("Testing " << nTest << " images\n");
+    for (u32 iTest = begin; iTest < end; iTest++)
+    {
+        ResetTopK(neighbours);
+        u8 *testImg = &testData.pixels[iTest * testData.pixelsPerImg];
+        u32 offset = job.testOffsets ? job.testOffsets[iTest] : 0;
+        for (u32 iTrain = 0; iTrain < trainData.nImages; iTrain++)
+        {
+            u8 *trainImg = &trainData.pixels[iTrain * trainData.pixelsPerImg];
+            u32 bound = neighbours.Bound();
+            bound = (bound > offset) ? bound - offset : 0;
+            u32 dist = offset + KnnDistance(job, trainImg, testImg, trainData.pixelsPerImg, bound);
+            TopKInsert(neighbours, dist, trainData.labels[iTrain]);
+        }
+        job.classifiedLabels[iTest] = (u8)ClassifyNeighbours(neighbours);
+    }
+}
+
+// NOTE(heyyod): Every chunk is a shard of the training set for a single test image (job.iTest).
+// The per thread lists are merged after the whole training set has been processed.
+template <top_k_policy Policy> func void
+KnnTrainShardWork(void *data, u32 begin, u32 end, u32 threadIndex)
+{
+    knn_cpu_job<Policy> &job = *(knn_cpu_job<Policy> *)data;
+    image_data &trainData = *job.trainData;
+    top_k<Policy> &neighbours = job.threadNeighbours[threadIndex * job.listsPerThread];
     
-    u32 *neighbourDists  = (u32 *)malloc(nNeighbours * sizeof(u32));
-    u8 *neighbourLabels = (u8 *)malloc(nNeighbours * sizeof (u8));
-    u32 furthestNeighbour = 0;
-    u32 nSuccess = 0;
+    u8 *testImg = &job.testData->pixels[job.iTest * job.testData->pixelsPerImg];
+    u32 offset = job.testOffsets ? job.testOffsets[job.iTest] : 0;
+    for (u32 iTrain = begin; iTrain < end; iTrain++)
+    {
+        u8 *trainImg = &trainData.pixels[iTrain * trainData.pixelsPerImg];
+        u32 bound = neighbours.Bound();
+        bound = (bound > offset) ? bound - offset : 0;
+        u32 dist = offset + KnnDistance(job, trainImg, testImg, trainData.pixelsPerImg, bound);
+        TopKInsert(neighbours, dist, trainData.labels[iTrain]);
+    }
+}
+
+// NOTE(heyyod): Batched squared euclidean distance using
+// ||a - b||^2 = ||a||^2 + ||b||^2 - 2 a.b
+// The norms of the training images are computed once, so what is left is the matrix product
+// of a block of test images with the training set. It is blocked so that a tile of
+// training images stays in L2 while every test image of the block goes over it, and the
+// dot kernel reuses each training row for DOT_KERNEL_IMAGES test images.
+// Everything is integer math so the distances are exactly the same as the direct ones.
+#define KNN_BATCHED_L2 1
+#define KNN_QUERY_BLOCK 64
+#define KNN_TRAIN_TILE 256
+
+func void
+ComputeSquaredNorms(image_data &data, u32 *normsOut)
+{
+    u8 *zeros = (u8 *)calloc(data.pixelsPerImg, sizeof(u8));
+    for (u32 iImg = 0; iImg < data.nImages; iImg++)
+        normsOut[iImg] = distanceKernels.l2Squared(&data.pixels[iImg * data.pixelsPerImg], zeros, data.pixelsPerImg);
+    free(zeros);
+}
+
+template <top_k_policy Policy> func void
+KnnBatchedL2Work(void *data, u32 begin, u32 end, u32 threadIndex)
+{
+    knn_cpu_job<Policy> &job = *(knn_cpu_job<Policy> *)data;
+    image_data &trainData = *job.trainData;
+    image_data &testData = *job.testData;
+    top_k<Policy> *neighbours = &job.threadNeighbours[threadIndex * job.listsPerThread];
+    u32 nPixels = trainData.pixelsPerImg;
+    u32 stride = job.wideStride;
     
-    TimeStart();
-    if (!vulkanEnabled)
+    u32 nQueries = end - begin;
+    Assert(nQueries <= KNN_QUERY_BLOCK);
+    
+    // NOTE(heyyod): Widen the test block to i16 once. The padding images and pixels stay
+    // zero so the kernels can always work on groups of DOT_KERNEL_IMAGES images.
+    i16 *wideTests = &job.threadWideTests[threadIndex * KNN_QUERY_BLOCK * stride];
+    memset(wideTests, 0, KNN_QUERY_BLOCK * stride * sizeof(i16));
+    u32 testNorms[KNN_QUERY_BLOCK];
+    for (u32 q = 0; q < nQueries; q++)
     {
-        Print("Running on CPU\n");  
-        for (u32 iTest = 0; iTest < nTest; iTest++)
+        u8 *testImg = &testData.pixels[(begin + q) * testData.pixelsPerImg];
+        u32 norm = 0;
+        for (u32 iPixel = 0; iPixel < nPixels; iPixel++)
         {
-            memset(neighbourDists, F32_MAX_HEX, nNeighbours * sizeof(f32));
-            for (u32 iTrain = 0; iTrain < trainData.nImages; iTrain++)
+            wideTests[q * stride + iPixel] = testImg[iPixel];
+            norm += (u32)testImg[iPixel] * testImg[iPixel];
+        }
+        testNorms[q] = norm + (job.testOffsets ? job.testOffsets[begin + q] : 0);
+        ResetTopK(neighbours[q]);
+    }
+    
+    for (u32 tileBegin = 0; tileBegin < trainData.nImages; tileBegin += KNN_TRAIN_TILE)
+    {
+        u32 tileEnd = Min(tileBegin + KNN_TRAIN_TILE, trainData.nImages);
+        for (u32 q = 0; q < nQueries; q += DOT_KERNEL_IMAGES)
+        {
+            u32 nGroup = Min(nQueries - q, (u32)DOT_KERNEL_IMAGES);
+            i16 *groupTests = &wideTests[q * stride];
+            for (u32 iTrain = tileBegin; iTrain < tileEnd; iTrain++)
             {
-                // NOTE(heyyod): calculate the distance using the minkowski distance formula
-                u32 dist = 0;
-                for (u32 iPixel = 0; iPixel < trainData.pixelsPerImg; iPixel++)
-                {
-                    f32 pixelDiff = (f32)(trainData.GetPixel(iTrain, iPixel) - testData.GetPixel(iTest, iPixel));
-                    dist += (u32)powf(pixelDiff, distP); 
-                }
+                u32 dots[DOT_KERNEL_IMAGES];
+                distanceKernels.dot4(&trainData.pixels[iTrain * nPixels], groupTests, nPixels, stride, dots);
                 
-                if (dist < neighbourDists[furthestNeighbour])
+                u32 trainNorm = job.trainNorms[iTrain];
+                u8 label = trainData.labels[iTrain];
+                for (u32 j = 0; j < nGroup; j++)
                 {
-                    // NOTE(heyyod): Update the neighbour distances and labels
-                    neighbourDists[furthestNeighbour] = dist;
-                    neighbourLabels[furthestNeighbour] = trainData.labels[iTrain];
-                    
-                    // NOTE(heyyod): Find the new furthest neighbour
-                    for (u32 iNeighbour = 0; iNeighbour < nNeighbours; iNeighbour++)
-                    {
-                        if (neighbourDists[iNeighbour] > neighbourDists[furthestNeighbour])
-                            furthestNeighbour = iNeighbour;
-                    }
+                    u32 dist = testNorms[q + j] + trainNorm - 2 * dots[j];
+                    TopKInsert(neighbours[q + j], dist, label);
                 }
             }
-            
-            // NOTE(heyyod): calculate label weights (inverse of distance)
-            // so that the nearest neighbours have greater weights
-            f32 labelWeights[NUM_CLASSES] = {};
-            u32 classifyLabel = 0;
-            for (u32 iNeighbour = 0; iNeighbour < nNeighbours; iNeighbour++)
-            {
-                u32 label = neighbourLabels[iNeighbour];
-                if (neighbourDists[iNeighbour] > 0)
-                    labelWeights[label] += 1.0f / neighbourDists[iNeighbour];
-                else
-                    Assert(0);
-                
-                if (labelWeights[classifyLabel] < labelWeights[label])
-                    classifyLabel = label;
-            }
-            
-            // NOTE(heyyod): Print some info
-            if (classifyLabel == testData.labels[iTest])
-                nSuccess++;
-#if PRINT_ENABLED
-            system("cls"); // clear console
-            std::cout << "~~~~~~ " <<  nNeighbours << " Nearest Neighbours Algorithm ~~~~~~" << std::endl;
-            std::cout << "Proccesed " << iTest + 1 << '\\' << nTest << ". ";
-            f32 rate = (f32)nSuccess / (f32) (iTest + 1);
-            std::cout << "\nSuccess rate: " << rate << std::endl;
-            PrintNumber(&testData.pixels[iTest * testData.pixelsPerImg], 28, 28);
-            std::cout << "Classified as: " << classifyLabel;
-#endif
         }
     }
-    else
+    
+    for (u32 q = 0; q < nQueries; q++)
+        job.classifiedLabels[begin + q] = (u8)ClassifyNeighbours(neighbours[q]);
+}
+
+template <top_k_policy Policy> func void
+KnnCpu(u32 nNeighbours, f32 distP, image_data &trainData, image_data &testData, u32 nTest, u8 *classifiedLabels)
+{
+    InitThreadPool();
+    InitDistanceKernels();
+    u32 nThreads = threadPool.nThreads;
+    Print("Running on CPU (" << nThreads << " threads, " << distanceKernels.name << ")\n");
+    
+    // NOTE(heyyod): Work on the variance ordered copy of the pixels when we have one.
+    // The train and test views share the layout of the training set order.
+    image_data train = trainData;
+    image_data test = testData;
+    u32 *testOffsets = 0;
+    bool ordered = trainData.orderedPixels && testData.orderedPixels && trainData.order == testData.order;
+    if (ordered)
     {
-        Print("Running on GPU\n");
+        pixel_order &order = *trainData.order;
+        Print("Variance ordered pixels (" << order.nKept << " of " << order.nPixels << " kept)\n");
+        train.pixels = trainData.orderedPixels;
+        train.pixelsPerImg = order.stride;
+        test.pixels = testData.orderedPixels;
+        test.pixelsPerImg = order.stride;
         
-        u32 *distPerImage = 0;
-        u64 distPerImageBufferSize = 0;
+        testOffsets = (u32 *)malloc(nTest * sizeof(u32));
+        for (u32 iTest = 0; iTest < nTest; iTest++)
+            testOffsets[iTest] = DroppedPixelsDistance(order, &testData.pixels[iTest * testData.pixelsPerImg], distP);
+    }
+    
+    bool batched = KNN_BATCHED_L2 && distP == 2.0f && nTest >= nThreads;
+    u32 listsPerThread = batched ? KNN_QUERY_BLOCK : 1;
+    u32 nLists = nThreads * listsPerThread;
+    
+    u32 *neighbourDists = (u32 *)malloc(nLists * nNeighbours * sizeof(u32));
+    u32 *neighbourLabels = (u32 *)malloc(nLists * nNeighbours * sizeof(u32));
+    top_k<Policy> *threadNeighbours = (top_k<Policy> *)malloc(nLists * sizeof(top_k<Policy>));
+    for (u32 iList = 0; iList < nLists; iList++)
+        InitTopK(threadNeighbours[iList], nNeighbours, &neighbourDists[iList * nNeighbours], &neighbourLabels[iList * nNeighbours]);
+    
+    knn_cpu_job<Policy> job = {};
+    job.trainData = &train;
+    job.testData = &test;
+    job.distP = distP;
+    job.testOffsets = testOffsets;
+    bool earlyAbandon = KNN_EARLY_ABANDON && ordered;
+    if (distP == 1.0f)
+    {
+        job.distanceKernel = distanceKernels.l1;
+        job.boundedKernel = earlyAbandon ? distanceKernels.l1Bounded : 0;
+    }
+    else if (distP == 2.0f)
+    {
+        job.distanceKernel = distanceKernels.l2Squared;
+        job.boundedKernel = earlyAbandon ? distanceKernels.l2SquaredBounded : 0;
+    }
+    job.threadNeighbours = threadNeighbours;
+    job.listsPerThread = listsPerThread;
+    job.classifiedLabels = classifiedLabels;
+    
+    if (batched)
+    {
+        Print("Batched euclidean distance\n");
         
-        Vulkan::AllocateKnnMemory(&distPerImage, distPerImageBufferSize);
-        Vulkan::CreatePipeline(PIPELINE_TYPE_NEAREST_NEIGHBOUR);
+        // NOTE(heyyod): Pad the widened rows to a full AVX-512 register
+        job.wideStride = (train.pixelsPerImg + 31) & ~31u;
+        job.threadWideTests = (i16 *)malloc(nThreads * KNN_QUERY_BLOCK * job.wideStride * sizeof(i16));
+        // NOTE(heyyod): The cached norms are of the full images, so they only work on the raw layout
+        bool cachedNorms = !ordered && trainData.squaredNorms;
+        if (cachedNorms)
+            job.trainNorms = trainData.squaredNorms;
+        else
+        {
+            job.trainNorms = (u32 *)malloc(train.nImages * sizeof(u32));
+            ComputeSquaredNorms(train, job.trainNorms);
+        }
         
-        // NOTE(heyyod): Shader only supports manhattan distance
+        ParallelFor(nTest, KNN_QUERY_BLOCK, KnnBatchedL2Work<Policy>, &job);
+        
+        if (!cachedNorms)
+            free(job.trainNorms);
+        free(job.threadWideTests);
+    }
+    else if (nTest >= nThreads)
+    {
+        // NOTE(heyyod): Enough test images to keep every thread busy. Small chunks so
+        // that the threads finish at roughly the same time.
+        ParallelFor(nTest, 4, KnnTestRangeWork<Policy>, &job);
+    }
+    else
+    {
+        // NOTE(heyyod): Too few test images. Split the training set instead
+        // and merge the k nearest of every thread.
+        u32 shardSize = Max(train.nImages / (nThreads * 4), 1u);
         for (u32 iTest = 0; iTest < nTest; iTest++)
         {
-            Vulkan::KnnCompute(iTest, (u32)distP);
+            for (u32 iThread = 0; iThread < nThreads; iThread++)
+                ResetTopK(threadNeighbours[iThread]);
             
-            memset(neighbourDists, F32_MAX_HEX, nNeighbours * sizeof(f32));
-            for (u32 iTrain = 0; iTrain < NUM_TRAIN_IMAGES; iTrain++)
+            job.iTest = iTest;
+            ParallelFor(train.nImages, shardSize, KnnTrainShardWork<Policy>, &job);
+            
+            for (u32 iThread = 1; iThread < nThreads; iThread++)
+                MergeTopK(threadNeighbours[0], threadNeighbours[iThread]);
+            classifiedLabels[iTest] = (u8)ClassifyNeighbours(threadNeighbours[0]);
+        }
+    }
+    
+    free(testOffsets);
+    free(threadNeighbours);
+    free(neighbourDists);
+    free(neighbourLabels);
+}
+
+template <top_k_policy Policy> func void
+KnnGpu(u32 nNeighbours, f32 distP, image_data &trainData, image_data &testData, u32 nTest, u8 *classifiedLabels)
+{
+    Print("Running on GPU\n");
+    
+    u32 *neighbourDists = (u32 *)malloc(nNeighbours * sizeof(u32));
+    u32 *neighbourLabels = (u32 *)malloc(nNeighbours * sizeof(u32));
+    top_k<Policy> neighbours;
+    InitTopK(neighbours, nNeighbours, neighbourDists, neighbourLabels);
+    
+    // NOTE(heyyod): For small k the gpu selects the neighbours and we only read back k pairs
+    // per test image. Otherwise the whole distance rows come back and we scan them here.
+    bool gpuTopK = (nNeighbours <= KNN_GPU_MAX_K);
+    
+    // NOTE(heyyod): The shader works on the original pixels, not the variance ordered ones
+    if (!Vulkan::UploadKnnPixels(trainData.pixels, trainData.nImages, testData.pixels, nTest, trainData.pixelsPerImg) ||
+        !Vulkan::AllocateKnnMemory(trainData.nImages, !gpuTopK) ||
+        !Vulkan::CreatePipeline(PIPELINE_TYPE_NEAREST_NEIGHBOUR) ||
+        (gpuTopK && !Vulkan::CreatePipeline(PIPELINE_TYPE_KNN_TOP_K)))
+    {
+        Print("Couldn't set up the knn on the gpu\n");
+        memset(classifiedLabels, 0, nTest);
+        free(neighbourDists);
+        free(neighbourLabels);
+        return;
+    }
+    u32 gpuK = gpuTopK ? nNeighbours : 0;
+    u32 wordsPerImage = KnnWordsPerImage(trainData.pixelsPerImg);
+    
+    // NOTE(heyyod): Shader only supports manhattan and squared euclidean distance
+    Assert(distP == 1.0f || distP == 2.0f);
+    
+    // NOTE(heyyod): Keep KNN_GPU_SLOTS batches queued on the gpu. While we wait for and
+    // classify the oldest one, the next ones are being computed.
+    u32 nBatches = (nTest + KNN_GPU_BATCH_SIZE - 1) / KNN_GPU_BATCH_SIZE;
+    u32 nSubmitted = 0;
+    u32 nClassified = 0;
+    bool failed = false;
+    for (; nSubmitted < Min(nBatches, (u32)KNN_GPU_SLOTS) && !failed; nSubmitted++)
+    {
+        u32 first = nSubmitted * KNN_GPU_BATCH_SIZE;
+        failed = !Vulkan::KnnSubmit(nSubmitted % KNN_GPU_SLOTS, first, Min(KNN_GPU_BATCH_SIZE, nTest - first), (u32)distP, trainData.nImages, wordsPerImage, gpuK);
+    }
+    
+    for (u32 iBatch = 0; iBatch < nBatches && !failed; iBatch++)
+    {
+        u32 slot = iBatch % KNN_GPU_SLOTS;
+        u32 firstTest = iBatch * KNN_GPU_BATCH_SIZE;
+        u32 nBatchTests = Min(KNN_GPU_BATCH_SIZE, nTest - firstTest);
+        if (!Vulkan::KnnWait(slot))
+        {
+            failed = true;
+            break;
+        }
+        
+        u32 *slotDists = gpuK ? 0 : Vulkan::KnnSlotDistances(slot);
+        gpu_neighbour *slotNeighbours = Vulkan::KnnSlotNeighbours(slot);
+        for (u32 i = 0; i < nBatchTests; i++)
+        {
+            Vulkan::KnnPoll();
+            ResetTopK(neighbours);
+            if (gpuK)
             {
-                u32 dist = distPerImage[iTrain];
-                if (dist < neighbourDists[furthestNeighbour])
+                gpu_neighbour *found = &slotNeighbours[i * gpuK];
+                for (u32 j = 0; j < gpuK; j++)
                 {
-                    // NOTE(heyyod): Update the neighbour distances and labels
-                    neighbourDists[furthestNeighbour] = dist;
-                    neighbourLabels[furthestNeighbour] = trainData.labels[iTrain];
-                    
-                    // NOTE(heyyod): Find the new furthest neighbour
-                    for (u32 iNeighbour = 0; iNeighbour < nNeighbours; iNeighbour++)
-                    {
-                        if (neighbourDists[iNeighbour] > neighbourDists[furthestNeighbour])
-                            furthestNeighbour = iNeighbour;
-                    }
+                    if (found[j].trainIndex != U32_MAX)
+                        TopKInsert(neighbours, found[j].dist, trainData.labels[found[j].trainIndex]);
                 }
             }
-            
-            // NOTE(heyyod): calculate label weights (inverse of distance)
-            // so that the nearest neighbours have greater weights
-            f32 labelWeights[NUM_CLASSES] = {};
-            u32 classifyLabel = 0;
-            for (u32 iNeighbour = 0; iNeighbour < nNeighbours; iNeighbour++)
+            else
             {
-                u32 label = neighbourLabels[iNeighbour];
-                if (neighbourDists[iNeighbour] > 0)
-                    labelWeights[label] += 1.0f / neighbourDists[iNeighbour];
-                else
-                    Assert(0);
-                
-                if (labelWeights[classifyLabel] < labelWeights[label])
-                    classifyLabel = label;
+                u32 *dists = &slotDists[(u64)i * trainData.nImages];
+                for (u32 iTrain = 0; iTrain < trainData.nImages; iTrain++)
+                {
+                    TopKInsert(neighbours, dists[iTrain], trainData.labels[iTrain]);
+                }
             }
-            
-            // NOTE(heyyod): Print some info
-            if (classifyLabel == testData.labels[iTest])
-                nSuccess++;
+            classifiedLabels[firstTest + i] = (u8)ClassifyNeighbours(neighbours);
+        }
+        nClassified = firstTest + nBatchTests;
+        
+        // NOTE(heyyod): The slot is free again, queue the next batch into it
+        if (nSubmitted < nBatches)
+        {
+            u32 first = nSubmitted * KNN_GPU_BATCH_SIZE;
+            failed = !Vulkan::KnnSubmit(slot, first, Min(KNN_GPU_BATCH_SIZE, nTest - first), (u32)distP, trainData.nImages, wordsPerImage, gpuK);
+            nSubmitted++;
         }
     }
-    TimeEnd();
+    // NOTE(heyyod): The other slots may still be running, their buffers can't be reused or
+    // freed before they finish. The tests we never got to count as failures.
+    if (failed)
+    {
+        Print("KNN compute failed\n");
+        for (u32 slot = 0; slot < KNN_GPU_SLOTS; slot++)
+            Vulkan::KnnWait(slot);
+        memset(classifiedLabels + nClassified, 0, nTest - nClassified);
+    }
     
     free(neighbourDists);
     free(neighbourLabels);
+}
+
+func f32
+KNearestNeighbour(u32 nNeighbours, f32 distP, image_data &trainData, image_data &testData, bool vulkanEnabled, u32 nTest = 0)
+{
+    std::cout << std::endl << nNeighbours << " Nearest Neighbours Algorithm" << std::endl;
+    
+    if (nTest == 0)
+        nTest = testData.nImages;
+    
+    Print("Testing " << nTest << " images\n");
+    
+    u8 *classifiedLabels = (u8 *)malloc(nTest * sizeof(u8));
+    
+    TimeStart();
+    if (!vulkanEnabled)
+    {
+        if (nNeighbours <= TOP_K_SORTED_MAX)
+            KnnCpu<TOP_K_SORTED>(nNeighbours, distP, trainData, testData, nTest, classifiedLabels);
+        else
+            KnnCpu<TOP_K_HEAP>(nNeighbours, distP, trainData, testData, nTest, classifiedLabels);
+    }
+    else
+    {
+        if (nNeighbours <= TOP_K_SORTED_MAX)
+            KnnGpu<TOP_K_SORTED>(nNeighbours, distP, trainData, testData, nTest, classifiedLabels);
+        else
+            KnnGpu<TOP_K_HEAP>(nNeighbours, distP, trainData, testData, nTest, classifiedLabels);
+    }
+    TimeEnd();
+    
+    u32 nSuccess = 0;
+    for (u32 iTest = 0; iTest < nTest; iTest++)
+    {
+        // NOTE(heyyod): Print some info
+        if (classifiedLabels[iTest] == testData.labels[iTest])
+            nSuccess++;
+#if PRINT_ENABLED
+        system("cls"); // clear console
+        std::cout << "~~~~~~ " <<  nNeighbours << " Nearest Neighbours Algorithm ~~~~~~" << std::endl;
+        std::cout << "Proccesed " << iTest + 1 << '\\' << nTest << ". ";
+        f32 rate = (f32)nSuccess / (f32) (iTest + 1);
+        std::cout << "\nSuccess rate: " << rate << std::endl;
+        PrintNumber(&testData.pixels[iTest * testData.pixelsPerImg], testData.width, testData.height);
+        std::cout << "Classified as: " << (u32)classifiedLabels[iTest];
+#endif
+    }
+    free(classifiedLabels);
     
     f32 rate = (f32)nSuccess / (f32)nTest;
     std::cout << "Success rate: " << rate << std::endl;
@@ -163,15 +514,24 @@ NearestCentroid(image_data &trainData, image_data &testData, u32 nTest = 0)
     // NOTE(heyyod): Find the centers of each class
     // NOTE(heyyod): Allocate one image per class. Pixels are f32 here because we
     // calculate the average value of each pixel from every image
-    f32 *centerPixels = (f32 *)malloc(NUM_CLASSES * trainData.pixelsPerImg * sizeof(f32));
-    memset(centerPixels, 0, NUM_CLASSES * trainData.pixelsPerImg * sizeof(f32));
-    u32 nPerTrainClass[NUM_CLASSES] = {};
+    u32 nClasses = trainData.nClasses;
+    f32 *centerPixels = (f32 *)malloc(nClasses * trainData.pixelsPerImg * sizeof(f32));
+    memset(centerPixels, 0, nClasses * trainData.pixelsPerImg * sizeof(f32));
+    u32 nPerTrainClass[MAX_CLASSES] = {};
     
     TimeStart();
-    for (u32 iTrain = 0; iTrain < trainData.nImages; iTrain++)
+    if (trainData.classOffsets)
     {
-        u8 label = trainData.labels[iTrain];
-        nPerTrainClass[label]++;
+        for (u32 iClass = 0; iClass < nClasses; iClass++)
+            nPerTrainClass[iClass] = trainData.classOffsets[iClass + 1] - trainData.classOffsets[iClass];
+    }
+    else
+    {
+        for (u32 iTrain = 0; iTrain < trainData.nImages; iTrain++)
+        {
+            u8 label = trainData.labels[iTrain];
+            nPerTrainClass[label]++;
+        }
     }
     
     for (u32 iTrain = 0; iTrain < trainData.nImages; iTrain++)
@@ -192,7 +552,7 @@ NearestCentroid(image_data &trainData, image_data &testData, u32 nTest = 0)
         f32 nearestClassDist = F32_MAX_EXP;
         u32 nearestClassLabel = 0;
         
-        for (u32 iClass = 0; iClass < NUM_CLASSES; iClass++)
+        for (u32 iClass = 0; iClass < nClasses; iClass++)
         {
             // NOTE(heyyod): calculate the distance using the minkowski distance formula
             f32 dist = 0.0f;
@@ -218,9 +578,9 @@ NearestCentroid(image_data &trainData, image_data &testData, u32 nTest = 0)
         std::cout << "Proccesed " << iTest + 1 << '\\' << nTest << ". ";
         f32 rate = (f32)nSuccess / (f32) (iTest + 1);
         std::cout << "\nSuccess rate: " << rate << std::endl;
-        PrintNumber(&testData.pixels[iTest * testData.pixelsPerImg], 28, 28);
+        PrintNumber(&testData.pixels[iTest * testData.pixelsPerImg], testData.width, testData.height);
         std::cout << "Classified as: " << nearestClassLabel;
-        PrintNumber(&centerPixels[nearestClassLabel * trainData.pixelsPerImg], 28, 28);
+        PrintNumber(&centerPixels[nearestClassLabel * trainData.pixelsPerImg], trainData.width, trainData.height);
         //Sleep(2000);
 #endif
     }
@@ -1,41 +1,210 @@
 #include "neural_net.h"
+#include "nn_kernels.cpp"
+#include "dataset_cache.h"
 
 #include <stdlib.h>
 #include <time.h>
 
-f32 *testProducts;
+// NOTE(heyyod): Weight rows per work chunk of the cpu feed forward. The rows stay in the cache
+// while every image of a batch goes through them, 64 rows of 784 floats are ~200KB.
+#define NN_CPU_BLOCK_ROWS 64
 
-func bool
-CreateNeuralNet(u32* layersDims, u32 nLayers, neural_net &net, image_data trainData, image_data testData)
+// NOTE(heyyod): Layers with fewer multiply-adds than this run on the calling thread. For a
+// single image of the mnist net, waking the thread pool costs more than the whole layer.
+#define NN_CPU_PARALLEL_MIN_WORK (1 << 18)
+
+func f32
+Sigmoid(f32 x)
 {
-    net.nLayers = nLayers;
-    net.layers = (layer *)malloc(nLayers * sizeof(layer));
-    if (!Vulkan::AllocateNeuralNetMemory(layersDims, nLayers, &net.weights, &net.biases, &net.values, &net.errors, &testProducts) ||
-        !Vulkan::CreatePipeline(PIPELINE_TYPE_FEED_FORWARD) ||
-        !Vulkan::CreatePipeline(PIPELINE_TYPE_BACK_PROPAGATE))
-        return false;
+    return 1.0f / (1.0f + expf(-x));
+}
+
+struct nn_feed_forward_job
+{
+    f32 *in[NN_BATCH_SIZE]; // one vector of inDim values per input
+    u32 nInputs;
+    u32 inDim;
+    f32 *weights; // outDim rows of inDim weights
+    f32 *biases;
+    f32 *out;     // nInputs vectors of outDim values
+    u32 outDim;
+};
+
+// NOTE(heyyod): Every chunk is a block of neurons (weight rows) for every input. The rows are
+// taken NN_DOT_ROWS at a time. At the end of the layer the last NN_DOT_ROWS rows are used
+// instead of a scalar tail, but only the rows of the chunk get written.
+func void
+FeedForwardWork(void *data, u32 begin, u32 end, u32 threadIndex)
+{
+    nn_feed_forward_job &job = *(nn_feed_forward_job *)data;
+    for (u32 iInput = 0; iInput < job.nInputs; iInput++)
+    {
+        f32 *in = job.in[iInput];
+        f32 *out = job.out + (u64)iInput * job.outDim;
+        if (job.outDim < NN_DOT_ROWS)
+        {
+            for (u32 row = begin; row < end; row++)
+            {
+                f32 dot = 0.0f;
+                for (u32 i = 0; i < job.inDim; i++)
+                    dot += in[i] * job.weights[(u64)row * job.inDim + i];
+                out[row] = Sigmoid(dot + job.biases[row]);
+            }
+            continue;
+        }
+        
+        for (u32 row = begin; row < end; row += NN_DOT_ROWS)
+        {
+            f32 dots[NN_DOT_ROWS];
+            u32 first = Min(row, job.outDim - NN_DOT_ROWS);
+            nnKernels.dotRows(in, job.weights + (u64)first * job.inDim, job.inDim, job.inDim, dots);
+            for (u32 i = row; i < Min(row + NN_DOT_ROWS, end); i++)
+                out[i] = Sigmoid(dots[i - first] + job.biases[i]);
+        }
+    }
+}
+
+func void
+FeedForwardCpu(nn_feed_forward_job &job)
+{
+    u64 work = (u64)job.nInputs * job.outDim * job.inDim;
+    if (work < NN_CPU_PARALLEL_MIN_WORK)
+    {
+        FeedForwardWork(&job, 0, job.outDim, 0);
+        return;
+    }
+    
+    // NOTE(heyyod): NN_DOT_ROWS aligned chunks so only the last one has a tail
+    u32 chunkSize = (job.outDim + threadPool.nThreads - 1) / threadPool.nThreads;
+    chunkSize = (chunkSize + NN_DOT_ROWS - 1) / NN_DOT_ROWS * NN_DOT_ROWS;
+    ParallelFor(job.outDim, Min(chunkSize, NN_CPU_BLOCK_ROWS), FeedForwardWork, &job);
+}
+
+// NOTE(heyyod): y += a[0] * rows[0][offset..] + ... + a[nRows - 1] * rows[nRows - 1][offset..]
+func void
+AxpyRows(f32 *a, f32 **rows, u32 nRows, u32 offset, f32 *y, u32 count)
+{
+    u32 r = 0;
+    for (; r + NN_DOT_ROWS <= nRows; r += NN_DOT_ROWS)
+    {
+        f32 *block[NN_DOT_ROWS];
+        for (u32 i = 0; i < NN_DOT_ROWS; i++)
+            block[i] = rows[r + i] + offset;
+        nnKernels.axpyRows(a + r, block, y, count);
+    }
+    for (; r < nRows; r++)
+        nnKernels.axpy(a[r], rows[r] + offset, y, count);
+}
+
+struct nn_back_propagate_batch_job
+{
+    u32 nInputs;
+    f32 *prevValues[NN_BATCH_SIZE]; // one row of prevDim values per input
+    f32 *values;     // [nInputs x dim]
+    f32 *errors;     // [nInputs x dim]
+    u32 dim;
+    f32 *weights;    // dim rows of prevDim weights
+    f32 *prevErrors; // [nInputs x prevDim], 0 for the input layer
+    u32 prevDim;
+    f32 learningRate;
+};
+
+// NOTE(heyyod): Every chunk is a range of weight columns, i.e. neurons of the previous layer,
+// like the workgroups of BackPropagate.comp, so no two threads write the same errors or
+// weights. For the chunk's columns the previous layer's errors are E * W with the old weights,
+// then W += lr * D^T * H where D are the deltas of the batch and H the previous layer's
+// values. Both products go NN_DOT_ROWS rows at a time.
+func void
+BackPropagateBatchWork(void *data, u32 begin, u32 end, u32 threadIndex)
+{
+    nn_back_propagate_batch_job &job = *(nn_back_propagate_batch_job *)data;
+    u32 count = end - begin;
     
-    // NOTE(heyyod): Normalize the input data
-    for (u32 i = 0; i < NUM_TRAIN_IMAGES; i++)
+    if (job.prevErrors)
     {
-        net.values[i] = (f32)trainData.pixels[i] / 255.0f;
+        f32 *weightRows[NN_DOT_ROWS];
+        for (u32 b = 0; b < job.nInputs; b++)
+        {
+            f32 *prevErrors = job.prevErrors + (u64)b * job.prevDim + begin;
+            f32 *errors = job.errors + (u64)b * job.dim;
+            memset(prevErrors, 0, count * sizeof(f32));
+            u32 j = 0;
+            for (; j + NN_DOT_ROWS <= job.dim; j += NN_DOT_ROWS)
+            {
+                for (u32 i = 0; i < NN_DOT_ROWS; i++)
+                    weightRows[i] = job.weights + (u64)(j + i) * job.prevDim + begin;
+                nnKernels.axpyRows(errors + j, weightRows, prevErrors, count);
+            }
+            for (; j < job.dim; j++)
+                nnKernels.axpy(errors[j], job.weights + (u64)j * job.prevDim + begin, prevErrors, count);
+        }
     }
-    for (u32 i = NUM_TRAIN_IMAGES; i < NUM_TRAIN_IMAGES + NUM_TEST_IMAGES; i++)
+    
+    f32 deltas[NN_BATCH_SIZE];
+    for (u32 j = 0; j < job.dim; j++)
     {
-        net.values[i] = (f32)testData.pixels[i] / 255.0f;
+        for (u32 b = 0; b < job.nInputs; b++)
+        {
+            f32 y = job.values[b * job.dim + j];
+            deltas[b] = job.learningRate * job.errors[b * job.dim + j] * y * (1.0f - y);
+        }
+        AxpyRows(deltas, job.prevValues, job.nInputs, begin, job.weights + (u64)j * job.prevDim + begin, count);
+    }
+}
+
+// NOTE(heyyod): The gradients of the batch are summed, not averaged, so learningRate means the
+// same as in per image training
+func void
+BackPropagateBatchCpu(nn_back_propagate_batch_job &job, f32 *biases)
+{
+    u64 work = 2 * (u64)job.nInputs * job.dim * job.prevDim;
+    if (work < NN_CPU_PARALLEL_MIN_WORK)
+        BackPropagateBatchWork(&job, 0, job.prevDim, 0);
+    else
+    {
+        u32 chunkSize = (job.prevDim + threadPool.nThreads - 1) / threadPool.nThreads;
+        chunkSize = (chunkSize + 15) / 16 * 16;
+        ParallelFor(job.prevDim, chunkSize, BackPropagateBatchWork, &job);
     }
     
+    for (u32 j = 0; j < job.dim; j++)
+    {
+        f32 delta = 0.0f;
+        for (u32 b = 0; b < job.nInputs; b++)
+        {
+            f32 y = job.values[b * job.dim + j];
+            delta += job.errors[b * job.dim + j] * y * (1.0f - y);
+        }
+        biases[j] += job.learningRate * delta;
+    }
+}
+
+func bool
+CreateNeuralNet(u32* layersDims, u32 nLayers, neural_net &net, image_data trainData, image_data testData, nn_backend backend)
+{
+    Assert(layersDims[0] == trainData.pixelsPerImg && layersDims[0] == testData.pixelsPerImg);
+    Assert(nLayers >= 3 && nLayers <= NN_MODEL_MAX_LAYERS);
+    
+    net.nLayers = nLayers;
+    net.nTrainImages = trainData.nImages;
+    net.trainDataChecksum = ImageDataChecksum(trainData);
+    net.layers = (layer *)malloc(nLayers * sizeof(layer));
+    u32 nInputImages = trainData.nImages + testData.nImages;
+    u32 nTrainValues = trainData.nImages * trainData.pixelsPerImg;
+    u32 nTestValues = testData.nImages * testData.pixelsPerImg;
+    
     net.layers[0].dimension= layersDims[0];
     net.layers[0].depth = 0;
     net.layers[0].valuesIndex = 0;
     // biases/weights/errorsIndex are ignored for layer[0] -> input layer
     
-    net.layers[1].valuesIndex = NUM_TRAIN_IMAGES + NUM_TEST_IMAGES;
+    net.layers[1].valuesIndex = nTrainValues + nTestValues;
     net.layers[1].biasesIndex = 0;
     net.layers[1].weightsIndex = 0;
     net.layers[1].errorsIndex= 0;
     
-    srand ((u32)time(0));
+    net.nWeights = 0;
+    net.nBiases = 0;
     for (u32 i = 1; i < nLayers; i++)
     {
         layer &prev = net.layers[i-1];
@@ -52,19 +221,106 @@ CreateNeuralNet(u32* layersDims, u32 nLayers, neural_net &net, image_data trainD
             curr.errorsIndex = prev.errorsIndex + prev.dimension;
             curr.weightsIndex = prev.weightsIndex + prev.dimension * prev.weightsDim;
         }
-        
-        // NOTE(heyyod): Randomize weights and biases
+        net.nWeights += layersDims[i] * layersDims[i - 1];
+        net.nBiases += layersDims[i];
+    }
+    
+    if (backend == NN_BACKEND_GPU &&
+        !(Vulkan::AllocateNeuralNetMemory(layersDims, nLayers, nInputImages, NN_BATCH_SIZE, &net.output) &&
+          Vulkan::CreatePipeline(PIPELINE_TYPE_FEED_FORWARD) &&
+          Vulkan::CreatePipeline(PIPELINE_TYPE_BACK_PROPAGATE)))
+    {
+        Print("Couldn't create the neural net on the gpu, falling back to the cpu\n");
+        backend = NN_BACKEND_CPU;
+    }
+    net.backend = backend;
+    
+    // NOTE(heyyod): Same layout as AllocateNeuralNetMemory, the values and errors of every
+    // layer after the input one have nBiases elements per image
+    if (backend == NN_BACKEND_CPU)
+    {
+        InitThreadPool();
+        InitNeuralNetKernels();
+        net.batchValues = (f32 *)malloc(NN_BATCH_SIZE * net.nBiases * sizeof(f32));
+        net.batchErrors = (f32 *)malloc(NN_BATCH_SIZE * net.nBiases * sizeof(f32));
+        if (!net.batchValues || !net.batchErrors)
+            return false;
+    }
+    
+    // NOTE(heyyod): Upload the normalized input data. The dataset cache already has it normalized,
+    // the cpu just points at it.
+    image_data *inputs[] = {&trainData, &testData};
+    u64 inputOffset = 0;
+    for (u32 i = 0; i < ArrayCount(inputs); i++)
+    {
+        image_data &input = *inputs[i];
+        u64 nValues = (u64)input.nImages * input.pixelsPerImg;
+        bool uploaded = true;
+        if (backend == NN_BACKEND_CPU)
+        {
+            net.inputs[i] = input.normalizedPixels;
+            if (!net.inputs[i])
+            {
+                net.ownedInputs[i] = (f32 *)malloc(nValues * sizeof(f32));
+                if (!net.ownedInputs[i])
+                    return false;
+                for (u64 j = 0; j < nValues; j++)
+                    net.ownedInputs[i][j] = (f32)input.pixels[j] / 255.0f;
+                net.inputs[i] = net.ownedInputs[i];
+            }
+        }
+        else if (input.normalizedPixels)
+            uploaded = Vulkan::UploadBuffer(vulkan.valuesBuffer, inputOffset * sizeof(f32), input.normalizedPixels, nValues * sizeof(f32));
+        else
+        {
+            f32 *normalized = (f32 *)malloc(nValues * sizeof(f32));
+            for (u64 j = 0; j < nValues; j++)
+                normalized[j] = (f32)input.pixels[j] / 255.0f;
+            uploaded = Vulkan::UploadBuffer(vulkan.valuesBuffer, inputOffset * sizeof(f32), normalized, nValues * sizeof(f32));
+            free(normalized);
+        }
+        if (!uploaded)
+            return false;
+        inputOffset += nValues;
+    }
+    
+    // NOTE(heyyod): Randomize weights and biases
+    f32 *weights = (f32 *)malloc(net.nWeights * sizeof(f32));
+    f32 *biases = (f32 *)malloc(net.nBiases * sizeof(f32));
+    srand ((u32)time(0));
+    for (u32 i = 1; i < nLayers; i++)
+    {
+        layer &curr = net.layers[i];
         for (u32 j = 0; j < curr.dimension; j++)
         {
-            net.biases[curr.biasesIndex + j] = RandomFloat(-1.0f, 1.0f);
+            biases[curr.biasesIndex + j] = RandomFloat(-1.0f, 1.0f);
             for (u32 k = 0; k < curr.weightsDim; k++)
             {
-                net.weights[curr.weightsIndex + curr.weightsDim * j + k] = RandomFloat(-1.0f, 1.0f);
+                weights[curr.weightsIndex + curr.weightsDim * j + k] = RandomFloat(-1.0f, 1.0f);
             }
         }
     }
     
+    if (backend == NN_BACKEND_CPU)
+    {
+        net.weights = weights;
+        net.biases = biases;
+    }
+    else
+    {
+        bool uploaded = (Vulkan::UploadBuffer(vulkan.weightsBuffer, 0, weights, net.nWeights * sizeof(f32)) &&
+                         Vulkan::UploadBuffer(vulkan.biasesBuffer, 0, biases, net.nBiases * sizeof(f32)));
+        free(weights);
+        free(biases);
+        if (!uploaded)
+            return false;
+    }
+    
     Print("\n---- Created Neural Network ----\n");
+    if (backend == NN_BACKEND_CPU)
+        Print("Running on CPU (" << threadPool.nThreads << " threads, " << nnKernels.name << ")\n");
+    else
+        Print("Running on GPU\n");
     Print("Layers: " << nLayers << '\n');
     for (u32 i = 0; i < nLayers; i++)
         Print("|  " << layersDims[i] << "  ");
@@ -72,80 +328,595 @@ CreateNeuralNet(u32* layersDims, u32 nLayers, neural_net &net, image_data trainD
     return true;
 }
 
-// TODO(heyyod): Save and Load Neural Net functions
+// NOTE(heyyod): Copies the net's current weights and biases into dstWeights/dstBiases
+func bool
+CopyParameters(neural_net &net, f32 *dstWeights, f32 *dstBiases)
+{
+    if (net.backend == NN_BACKEND_GPU)
+    {
+        return (Vulkan::DownloadBuffer(vulkan.weightsBuffer, 0, dstWeights, net.nWeights * sizeof(f32)) &&
+                Vulkan::DownloadBuffer(vulkan.biasesBuffer, 0, dstBiases, net.nBiases * sizeof(f32)));
+    }
+    memcpy(dstWeights, net.weights, net.nWeights * sizeof(f32));
+    memcpy(dstBiases, net.biases, net.nBiases * sizeof(f32));
+    return true;
+}
+
+func bool
+RestoreParameters(neural_net &net, f32 *weights, f32 *biases)
+{
+    if (net.backend == NN_BACKEND_GPU)
+    {
+        return (Vulkan::UploadBuffer(vulkan.weightsBuffer, 0, weights, net.nWeights * sizeof(f32)) &&
+                Vulkan::UploadBuffer(vulkan.biasesBuffer, 0, biases, net.nBiases * sizeof(f32)));
+    }
+    memcpy(net.weights, weights, net.nWeights * sizeof(f32));
+    memcpy(net.biases, biases, net.nBiases * sizeof(f32));
+    return true;
+}
+
+// NOTE(heyyod): Writes the whole file to a temporary one first and moves it over filepath,
+// so a process that has the old model mapped never sees a half written file.
+func bool
+SaveNeuralNet(neural_net &net, char *filepath)
+{
+    u64 headerSpace = AlignUp(sizeof(nn_model_header), NN_MODEL_ALIGNMENT);
+    u64 layersSpace = AlignUp(net.nLayers * sizeof(nn_model_layer), NN_MODEL_ALIGNMENT);
+    u64 weightsSpace = AlignUp(net.nWeights * sizeof(f32), NN_MODEL_ALIGNMENT);
+    u64 biasesSpace = AlignUp(net.nBiases * sizeof(f32), NN_MODEL_ALIGNMENT);
+    
+    nn_model_header header = {};
+    header.magic = NN_MODEL_MAGIC;
+    header.version = NN_MODEL_VERSION;
+    header.headerSize = sizeof(nn_model_header);
+    header.nLayers = net.nLayers;
+    header.nWeights = net.nWeights;
+    header.nBiases = net.nBiases;
+    header.datasetChecksum = net.trainDataChecksum;
+    header.layersOffset = headerSpace;
+    header.weightsOffset = header.layersOffset + layersSpace;
+    header.biasesOffset = header.weightsOffset + weightsSpace;
+    header.fileSize = header.biasesOffset + biasesSpace;
+    
+    // NOTE(heyyod): A model is small enough to build in memory and write at once
+    u8 *memory = (u8 *)calloc(header.fileSize, 1);
+    if (!memory)
+        return false;
+    nn_model_layer *layers = (nn_model_layer *)(memory + header.layersOffset);
+    for (u32 i = 0; i < net.nLayers; i++)
+    {
+        layers[i].dimension = LayerDim(net, i);
+        if (i > 0)
+        {
+            layers[i].weightsDim = LayerWeightsDim(net, i);
+            layers[i].weightsIndex = LayerWeightsIndex(net, i);
+            layers[i].biasesIndex = LayerBiasesIndex(net, i);
+        }
+    }
+    if (!CopyParameters(net, (f32 *)(memory + header.weightsOffset), (f32 *)(memory + header.biasesOffset)))
+    {
+        free(memory);
+        return false;
+    }
+    header.checksum = DatasetChecksum(DATASET_CHECKSUM_SEED, memory + headerSpace, header.fileSize - headerSpace);
+    memcpy(memory, &header, sizeof(header));
+    
+    char tempPath[1024];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", filepath);
+    FILE *file = fopen(tempPath, "wb");
+    bool success = file && fwrite(memory, 1, header.fileSize, file) == header.fileSize;
+    if (file)
+        success = (fclose(file) == 0) && success;
+    free(memory);
+    success = success && MoveFileOver(tempPath, filepath);
+    if (!success)
+        remove(tempPath);
+    return success;
+}
+
+// NOTE(heyyod): Maps a model written by SaveNeuralNet after checking that its header, layer
+// table and checksum agree.
+func bool
+MapNeuralNetModel(char *filepath, nn_model &modelOut)
+{
+    mapped_file modelFile;
+    if (!MapFile(filepath, modelFile))
+        return false;
+    
+    nn_model_header header = {};
+    bool valid = modelFile.size >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, modelFile.memory, sizeof(header));
+        u64 headerSpace = AlignUp(sizeof(nn_model_header), NN_MODEL_ALIGNMENT);
+        valid = header.magic == NN_MODEL_MAGIC &&
+            header.version == NN_MODEL_VERSION &&
+            header.headerSize == sizeof(nn_model_header) &&
+            header.fileSize == modelFile.size &&
+            header.nLayers >= 2 && header.nLayers <= NN_MODEL_MAX_LAYERS &&
+            header.layersOffset == headerSpace &&
+            header.weightsOffset == header.layersOffset + AlignUp(header.nLayers * sizeof(nn_model_layer), NN_MODEL_ALIGNMENT) &&
+            header.biasesOffset == header.weightsOffset + AlignUp((u64)header.nWeights * sizeof(f32), NN_MODEL_ALIGNMENT) &&
+            header.fileSize == header.biasesOffset + AlignUp((u64)header.nBiases * sizeof(f32), NN_MODEL_ALIGNMENT);
+        if (valid)
+        {
+            u64 checksum = DatasetChecksum(DATASET_CHECKSUM_SEED, modelFile.memory + headerSpace, modelFile.size - headerSpace);
+            valid = checksum == header.checksum;
+            if (!valid)
+                Print("Model " << filepath << " is corrupted\n");
+        }
+    }
+    
+    // NOTE(heyyod): The layers have to tile the weights and biases exactly like CreateNeuralNet
+    // lays them out
+    nn_model_layer *layers = (nn_model_layer *)(modelFile.memory + header.layersOffset);
+    u64 nWeights = 0;
+    u64 nBiases = 0;
+    for (u32 i = 1; valid && i < header.nLayers; i++)
+    {
+        valid = layers[i].dimension > 0 &&
+            layers[i].weightsDim == layers[i - 1].dimension &&
+            layers[i].weightsIndex == nWeights &&
+            layers[i].biasesIndex == nBiases;
+        nWeights += (u64)layers[i].dimension * layers[i].weightsDim;
+        nBiases += layers[i].dimension;
+    }
+    valid = valid && layers[0].dimension > 0 && nWeights == header.nWeights && nBiases == header.nBiases;
+    if (!valid)
+    {
+        UnmapFile(modelFile);
+        return false;
+    }
+    
+    AdviseMapping(modelFile, MAP_ADVICE_WILLNEED);
+    
+    modelOut = {};
+    modelOut.nLayers = header.nLayers;
+    modelOut.nWeights = header.nWeights;
+    modelOut.nBiases = header.nBiases;
+    modelOut.datasetChecksum = header.datasetChecksum;
+    modelOut.layers = layers;
+    modelOut.weights = (f32 *)(modelFile.memory + header.weightsOffset);
+    modelOut.biases = (f32 *)(modelFile.memory + header.biasesOffset);
+    modelOut.file = modelFile;
+    return true;
+}
+
+func void
+UnmapNeuralNetModel(nn_model &model)
+{
+    UnmapFile(model.file);
+    model = {};
+}
+
+// NOTE(heyyod): Replaces the weights and biases of net with the ones of the model file, if
+// the file has the same layers and was trained on the same data.
+func bool
+LoadNeuralNet(neural_net &net, char *filepath)
+{
+    nn_model model;
+    if (!MapNeuralNetModel(filepath, model))
+        return false;
+    
+    bool matches = model.nLayers == net.nLayers;
+    for (u32 i = 0; matches && i < net.nLayers; i++)
+        matches = model.layers[i].dimension == LayerDim(net, i);
+    if (!matches)
+        Print("Model " << filepath << " has different layers than the net\n");
+    else if (model.datasetChecksum != net.trainDataChecksum)
+    {
+        Print("Model " << filepath << " was trained on a different data set\n");
+        matches = false;
+    }
+    
+    bool success = matches && RestoreParameters(net, model.weights, model.biases);
+    UnmapNeuralNetModel(model);
+    return success;
+}
+
 
 func void
 FreeNeuralNet(neural_net &net)
 {
+    if (net.backend == NN_BACKEND_CPU)
+    {
+        free(net.ownedInputs[0]);
+        free(net.ownedInputs[1]);
+        free(net.weights);
+        free(net.biases);
+    }
+    free(net.batchValues);
+    free(net.batchErrors);
     free(net.layers);
+    net = {};
+}
+
+// NOTE(heyyod): Cpu only. The normalized pixels of an image of the input layer, the test
+// images come after the training ones.
+inline f32 *
+InputValues(neural_net &net, u32 imgIndex)
+{
+    u32 set = (imgIndex >= net.nTrainImages);
+    u32 index = set ? imgIndex - net.nTrainImages : imgIndex;
+    return &net.inputs[set][(u64)index * LayerDim(net, 0)];
 }
 
+// NOTE(heyyod): Records the feed forward of the images BeginNeuralNetCommands got. The gpu has
+// the values of the batch after the input images, in the layout of net.batchValues.
 func void
-FeedForward(neural_net &net, u32 imgIndex)
+FeedForwardGpu(neural_net &net, u32 nImages)
+{
+    push_constants_feed_forward layers[NN_MODEL_MAX_LAYERS];
+    for (u32 iLayer = 1; iLayer < net.nLayers; iLayer++)
+    {
+        push_constants_feed_forward &pc = layers[iLayer - 1];
+        pc = {};
+        pc.inValuesIndex = (iLayer == 1) ? LayerValuesIndex(net, 0) : LayerGpuValuesIndex(net, iLayer - 1);
+        pc.inValuesDim = LayerDim(net, iLayer - 1);
+        pc.weightsIndex = LayerWeightsIndex(net, iLayer);
+        pc.weightsDim = LayerWeightsDim(net, iLayer);
+        pc.biasesIndex = LayerBiasesIndex(net, iLayer);
+        pc.outValuesIndex = LayerGpuValuesIndex(net, iLayer);
+        pc.outValuesDim = LayerDim(net, iLayer);
+        pc.inputLayer = (iLayer == 1);
+    }
+    Vulkan::FeedForwardCompute(layers, net.nLayers - 1, nImages);
+}
+
+// NOTE(heyyod): Runs nImages input vectors through the layers of net with the given weights
+// and biases. The values of every layer go to batchValues, in the layout of net.batchValues,
+// and the output layer's are returned. Without threads it only touches its arguments, so it
+// can run on any thread while the net trains.
+func f32 *
+FeedForwardLayersCpu(neural_net &net, f32 *weights, f32 *biases, f32 **inputs, u32 nImages, f32 *batchValues, bool useThreads)
 {
+    nn_feed_forward_job job = {};
+    job.nInputs = nImages;
+    for (u32 b = 0; b < nImages; b++)
+        job.in[b] = inputs[b];
+    
+    f32 *out = 0;
     for (u32 iLayer = 0; iLayer < net.nLayers - 1; iLayer++)
     {
-        u32 inValuesIndex = LayerValuesIndex(net, iLayer);
-        if (iLayer == 0)
-            inValuesIndex += imgIndex * LayerDim(net, 0);
-        
-        u32 inValuesDim = LayerDim(net, iLayer);
-        
-        u32 weightsIndex = LayerWeightsIndex(net, iLayer + 1);
-        u32 weightsDim = LayerWeightsDim(net, iLayer + 1);
+        job.inDim = LayerDim(net, iLayer);
+        job.weights = &weights[LayerWeightsIndex(net, iLayer + 1)];
+        job.biases = &biases[LayerBiasesIndex(net, iLayer + 1)];
+        job.out = &batchValues[NN_BATCH_SIZE * (LayerValuesIndex(net, iLayer + 1) - LayerValuesIndex(net, 1))];
+        job.outDim = LayerDim(net, iLayer + 1);
+        if (useThreads)
+            FeedForwardCpu(job);
+        else
+            FeedForwardWork(&job, 0, job.outDim, 0);
         
-        u32 biasesIndex =  LayerBiasesIndex(net, iLayer + 1);
-        
-        u32 outValuesIndex = LayerValuesIndex(net, iLayer + 1);
-        u32 outValuesDim = LayerDim(net, iLayer + 1);
-        
-        Vulkan::FeedForwardCompute(inValuesIndex, inValuesDim, weightsIndex, weightsDim, biasesIndex, outValuesIndex, outValuesDim);
+        out = job.out;
+        for (u32 b = 0; b < nImages; b++)
+            job.in[b] = out + b * job.outDim;
     }
+    return out;
 }
 
+// NOTE(heyyod): Runs the images through the net and returns their output values, one
+// OutputLayerDim(net) vector per image. On the cpu every layer is a single matrix product,
+// so the weights are read once per batch instead of once per image. On the gpu the batch is a
+// single submit.
+func f32 *
+FeedForwardBatch(neural_net &net, u32 *images, u32 nImages)
+{
+    Assert(nImages <= NN_BATCH_SIZE);
+    u32 outDim = OutputLayerDim(net);
+    if (net.backend == NN_BACKEND_GPU)
+    {
+        if (Vulkan::BeginNeuralNetCommands(images, 0, nImages))
+        {
+            FeedForwardGpu(net, nImages);
+            Vulkan::CopyOutputCompute(LayerGpuValuesIndex(net, net.nLayers - 1), nImages * outDim);
+            Vulkan::SubmitNeuralNetCommands();
+        }
+        return OutputLayerValues(net);
+    }
+    
+    f32 *inputs[NN_BATCH_SIZE];
+    for (u32 i = 0; i < nImages; i++)
+        inputs[i] = InputValues(net, images[i]);
+    return FeedForwardLayersCpu(net, net.weights, net.biases, inputs, nImages, net.batchValues, true);
+}
+
+// NOTE(heyyod): Records the back propagation of the batch after its FeedForwardGpu. The output
+// errors come from the labels BeginNeuralNetCommands got, the others stay in the errors buffer
+// in the layout of net.batchErrors.
 func void
-BackPropagate(neural_net &net, u32 trainIndex, f32 learningRate)
+BackPropagateGpu(neural_net &net, u32 nImages, f32 learningRate)
 {
+    push_constants_back_propagate layers[NN_MODEL_MAX_LAYERS];
+    u32 nRecorded = 0;
     for (u32 iLayer = net.nLayers - 1; iLayer > 0; iLayer--)
     {
-        u32 prevLayerValuesIndex = LayerValuesIndex(net, iLayer-1);
-        if (iLayer == 1)
-            prevLayerValuesIndex *= trainIndex * LayerDim(net, iLayer-1);
+        push_constants_back_propagate &pc = layers[nRecorded++];
+        pc = {};
+        pc.currLayerValuesIndex = LayerGpuValuesIndex(net, iLayer);
+        pc.prevLayerValuesIndex = (iLayer == 1) ? LayerValuesIndex(net, 0) : LayerGpuValuesIndex(net, iLayer - 1);
+        pc.inErrorsIndex = NN_BATCH_SIZE * LayerErrorsIndex(net, iLayer);
+        pc.inErrorsDim = LayerDim(net, iLayer);
+        pc.weightsIndex = LayerWeightsIndex(net, iLayer);
+        pc.weightsDim = LayerWeightsDim(net, iLayer);
+        pc.biasesIndex = LayerBiasesIndex(net, iLayer);
+        pc.outErrorsIndex = (iLayer > 1) ? NN_BATCH_SIZE * LayerErrorsIndex(net, iLayer - 1) : 0;
+        pc.outErrorsDim = LayerDim(net, iLayer - 1);
+        pc.learningRate = learningRate;
+        pc.layerIndex = iLayer;
+        pc.nImages = nImages;
+        pc.outputLayer = (iLayer == net.nLayers - 1);
+    }
+    Vulkan::BackPropagateCompute(layers, nRecorded);
+}
+
+// NOTE(heyyod): Back propagates the output errors in LayerBatchErrors of the images after a
+// FeedForwardBatch of the same images. Only the cpu backend has the batch buffers.
+func void
+BackPropagateBatch(neural_net &net, u32 *images, u32 nImages, f32 learningRate)
+{
+    Assert(net.backend == NN_BACKEND_CPU && nImages <= NN_BATCH_SIZE);
+    for (u32 iLayer = net.nLayers - 1; iLayer > 0; iLayer--)
+    {
+        nn_back_propagate_batch_job job = {};
+        job.nInputs = nImages;
+        job.values = LayerBatchValues(net, iLayer);
+        job.errors = LayerBatchErrors(net, iLayer);
+        job.dim = LayerDim(net, iLayer);
+        job.weights = &net.weights[LayerWeightsIndex(net, iLayer)];
+        job.prevErrors = (iLayer > 1) ? LayerBatchErrors(net, iLayer - 1) : 0;
+        job.prevDim = LayerDim(net, iLayer - 1);
+        job.learningRate = learningRate;
+        for (u32 b = 0; b < nImages; b++)
+        {
+            if (iLayer == 1)
+                job.prevValues[b] = InputValues(net, images[b]);
+            else
+                job.prevValues[b] = LayerBatchValues(net, iLayer - 1) + b * job.prevDim;
+        }
+        BackPropagateBatchCpu(job, &net.biases[LayerBiasesIndex(net, iLayer)]);
+    }
+}
+
+// NOTE(heyyod): One weight update from the images. On the gpu the output errors come from the
+// labels in the shader, so the whole batch is a single submit.
+func void
+TrainBatch(neural_net &net, image_data &trainData, u32 *images, u32 nImages, f32 learningRate)
+{
+    u32 outDim = OutputLayerDim(net);
+    if (net.backend == NN_BACKEND_GPU)
+    {
+        u32 labels[NN_BATCH_SIZE];
+        for (u32 b = 0; b < nImages; b++)
+            labels[b] = trainData.labels[images[b]];
+        if (!Vulkan::BeginNeuralNetCommands(images, labels, nImages))
+            return;
+        FeedForwardGpu(net, nImages);
+        BackPropagateGpu(net, nImages, learningRate);
+        Vulkan::SubmitNeuralNetCommands();
+        return;
+    }
+    
+    f32 *outputs = FeedForwardBatch(net, images, nImages);
+    f32 *outputErrors = LayerBatchErrors(net, net.nLayers - 1);
+    for (u32 b = 0; b < nImages; b++)
+    {
+        for (u32 i = 0; i < outDim; i++)
+        {
+            f32 target = (i == trainData.labels[images[b]]) ? 1.0f : 0.0f;
+            outputErrors[b * outDim + i] = (target - outputs[b * outDim + i]);
+        }
+    }
+    BackPropagateBatch(net, images, nImages, learningRate);
+}
+
+// NOTE(heyyod): xorshift64*, rand() only has 15 bits on some platforms
+func u32
+RandomU32(u64 &state)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (u32)((state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+func void
+ShuffleIndices(u32 *indices, u32 count, u64 &rngState)
+{
+    for (u32 i = count; i > 1; i--)
+    {
+        u32 j = (u32)(((u64)RandomU32(rngState) * i) >> 32);
+        u32 temp = indices[i - 1];
+        indices[i - 1] = indices[j];
+        indices[j] = temp;
+    }
+}
+
+// NOTE(heyyod): The validation of an epoch runs on its own thread while the next epoch trains.
+// It works on a copy of the weights and biases with the cpu kernels, so it doesn't touch
+// anything the training uses, on either backend.
+struct nn_validation
+{
+    neural_net *net; // only the layer table is read
+    image_data *data;
+    u32 *images;
+    u32 nImages;
+    
+    f32 *weights;
+    f32 *biases;
+    f32 *inputs;      // NN_BATCH_SIZE normalized images, when data has no normalizedPixels
+    f32 *batchValues; // same layout as net.batchValues
+    
+    u32 epoch;
+    f32 accuracy;
+    f32 loss; // mean squared error of the outputs
+    std::thread thread;
+    bool running;
+};
+
+func void
+RunValidation(nn_validation *validation)
+{
+    nn_validation &v = *validation;
+    neural_net &net = *v.net;
+    u32 inDim = LayerDim(net, 0);
+    u32 outDim = OutputLayerDim(net);
+    
+    u32 nSuccess = 0;
+    f64 loss = 0.0;
+    for (u32 iImage = 0; iImage < v.nImages; iImage += NN_BATCH_SIZE)
+    {
+        u32 nBatch = Min(NN_BATCH_SIZE, v.nImages - iImage);
+        f32 *inputs[NN_BATCH_SIZE];
+        for (u32 b = 0; b < nBatch; b++)
+        {
+            u64 first = (u64)v.images[iImage + b] * inDim;
+            if (v.data->normalizedPixels)
+                inputs[b] = &v.data->normalizedPixels[first];
+            else
+            {
+                inputs[b] = &v.inputs[b * inDim];
+                for (u32 i = 0; i < inDim; i++)
+                    inputs[b][i] = (f32)v.data->pixels[first + i] / 255.0f;
+            }
+        }
         
-        Vulkan::BackPropagateCompute(LayerValuesIndex(net, iLayer), prevLayerValuesIndex,
-                                     LayerErrorsIndex(net, iLayer), LayerDim(net, iLayer),
-                                     LayerWeightsIndex(net, iLayer), LayerWeightsDim(net, iLayer),
-                                     LayerBiasesIndex(net, iLayer),
-                                     LayerErrorsIndex(net, iLayer - 1), LayerDim(net, iLayer - 1),
-                                     learningRate, iLayer);
+        f32 *outputs = FeedForwardLayersCpu(net, v.weights, v.biases, inputs, nBatch, v.batchValues, false);
+        for (u32 b = 0; b < nBatch; b++)
+        {
+            f32 *output = outputs + b * outDim;
+            u32 label = v.data->labels[v.images[iImage + b]];
+            u32 classify = 0;
+            for (u32 i = 0; i < outDim; i++)
+            {
+                f32 error = ((i == label) ? 1.0f : 0.0f) - output[i];
+                loss += error * error;
+                if (output[i] > output[classify])
+                    classify = i;
+            }
+            if (classify == label)
+                nSuccess++;
+        }
     }
+    v.accuracy = (f32)nSuccess / (f32)v.nImages;
+    v.loss = (f32)(loss / v.nImages);
 }
 
+// NOTE(heyyod): Trains for up to options.nEpochs passes over the training images. They are only
+// accessed through a shuffled list of indices, the pixels never move. The first part of the
+// list is held out for validation and the rest is reshuffled every epoch. Training stops when
+// the validation loss hasn't improved for options.patience epochs and the net ends up with the
+// weights of its best epoch. The loss still moves when the accuracy is tied, the accuracy only
+// breaks ties of the loss. Since the validation of an epoch finishes while the
+// next one trains, the plateau is noticed one epoch late.
 func void
-TrainNeuralNet(neural_net &net, image_data &trainData, f32 learningRate)
+TrainNeuralNet(neural_net &net, image_data &trainData, nn_train_options options)
 {
     Print("\n---- Training Neural Net ----\n");
+    u32 batchSize = Max(1, Min(options.batchSize, NN_BATCH_SIZE));
+    u32 nEpochs = Max(1, options.nEpochs);
+    
+    u32 *indices = (u32 *)malloc(trainData.nImages * sizeof(u32));
+    for (u32 i = 0; i < trainData.nImages; i++)
+        indices[i] = i;
+    u64 rngState = ((u64)time(0) << 1) | 1;
+    ShuffleIndices(indices, trainData.nImages, rngState);
+    
+    u32 nValidation = (u32)(Max(0.0f, Min(options.validationSplit, 0.5f)) * trainData.nImages);
+    u32 *trainIndices = indices + nValidation;
+    u32 nTrain = trainData.nImages - nValidation;
+    Print("Batch size: " << batchSize << ", train images: " << nTrain << ", validation images: " << nValidation << '\n');
+    
+    nn_validation validation = {};
+    f32 *bestWeights = 0;
+    f32 *bestBiases = 0;
+    f32 bestLoss = F32_MAX_EXP;
+    f32 bestAccuracy = -1.0f;
+    u32 bestEpoch = 0;
+    if (nValidation)
+    {
+        validation.net = &net;
+        validation.data = &trainData;
+        validation.images = indices;
+        validation.nImages = nValidation;
+        validation.weights = (f32 *)malloc(net.nWeights * sizeof(f32));
+        validation.biases = (f32 *)malloc(net.nBiases * sizeof(f32));
+        validation.inputs = (f32 *)malloc(NN_BATCH_SIZE * LayerDim(net, 0) * sizeof(f32));
+        validation.batchValues = (f32 *)malloc(NN_BATCH_SIZE * net.nBiases * sizeof(f32));
+        bestWeights = (f32 *)malloc(net.nWeights * sizeof(f32));
+        bestBiases = (f32 *)malloc(net.nBiases * sizeof(f32));
+        InitNeuralNetKernels();
+    }
+    
     TimeStart();
-    for (u32 iTrain  = 0; iTrain < NUM_TRAIN_IMAGES; iTrain++)
+    bool stop = false;
+    for (u32 epoch = 0; epoch < nEpochs && !stop; epoch++)
     {
-        FeedForward(net, iTrain);
-        
-        f32 target[10] = {};
-        target[trainData.labels[iTrain]] = 1.0f;
-        f32 *output = OutputLayerValues(net);
-        f32 *outputErrors = OutputLayerErrors(net);
-        for (u32 i = 0; i < 10; i++)
-            outputErrors[i] = (target[i] - output[i]);
-        
-        BackPropagate(net, iTrain, learningRate);
+        std::chrono::steady_clock::time_point epochStart = Now();
+        ShuffleIndices(trainIndices, nTrain, rngState);
+        for (u32 iTrain  = 0; iTrain < nTrain; iTrain += batchSize)
+        {
+            u32 nBatch = Min(batchSize, nTrain - iTrain);
+            TrainBatch(net, trainData, &trainIndices[iTrain], nBatch, options.learningRate);
+        }
+        std::chrono::duration<f32> epochTime = Now() - epochStart;
+        Print("Epoch " << epoch + 1 << '/' << nEpochs << " trained in " << epochTime.count() << "s\n");
         
-        if (iTrain % 10000 == 0)
+        // NOTE(heyyod): Collect the previous epoch's validation and start this one's. The last
+        // epoch is validated right away.
+        for (u32 pass = 0; pass < 2 && nValidation; pass++)
         {
-            Print("Processed " << iTrain << '/' << NUM_TRAIN_IMAGES << '\n');
+            if (validation.running)
+            {
+                validation.thread.join();
+                validation.running = false;
+                Print("    Validation of epoch " << validation.epoch + 1 << ": accuracy " << validation.accuracy << ", loss " << validation.loss << '\n');
+                if (validation.loss < bestLoss ||
+                    (validation.loss == bestLoss && validation.accuracy > bestAccuracy))
+                {
+                    bestLoss = validation.loss;
+                    bestAccuracy = validation.accuracy;
+                    bestEpoch = validation.epoch;
+                    memcpy(bestWeights, validation.weights, net.nWeights * sizeof(f32));
+                    memcpy(bestBiases, validation.biases, net.nBiases * sizeof(f32));
+                }
+                else if (validation.epoch - bestEpoch >= options.patience)
+                {
+                    Print("Validation loss stopped improving, stopping early\n");
+                    stop = true;
+                }
+            }
+            
+            if (pass == 0 && !stop)
+            {
+                if (!CopyParameters(net, validation.weights, validation.biases))
+                    break;
+                validation.epoch = epoch;
+                validation.running = true;
+                validation.thread = std::thread(RunValidation, &validation);
+            }
+            if (epoch + 1 < nEpochs && !stop)
+                break;
         }
     }
     TimeEnd();
     PrintTimeElapsed();
+    
+    if (validation.running)
+        validation.thread.join();
+    if (bestAccuracy >= 0.0f)
+    {
+        Print("Keeping the weights of epoch " << bestEpoch + 1 << " (validation loss " << bestLoss << ", accuracy " << bestAccuracy << ")\n");
+        RestoreParameters(net, bestWeights, bestBiases);
+    }
+    
+    free(validation.weights);
+    free(validation.biases);
+    free(validation.inputs);
+    free(validation.batchValues);
+    free(bestWeights);
+    free(bestBiases);
+    free(indices);
 }
 
 func void
@@ -154,21 +925,28 @@ TestNeuralNet(neural_net &net, image_data &testData, u32 nTest)
     Print("\n---- Testing Neural Net ----\n");
     TimeStart();
     u32 nSuccess = 0;
-    for (u32 iTest  = 0; iTest < nTest; iTest++)
+    u32 outDim = OutputLayerDim(net);
+    u32 images[NN_BATCH_SIZE];
+    for (u32 iTest  = 0; iTest < nTest; iTest += NN_BATCH_SIZE)
     {
-        FeedForward(net, iTest + NUM_TRAIN_IMAGES);
-        
-        u32 classify = 0;
-        f32 *output = OutputLayerValues(net);
-        for (u32 i = 1; i < OutputLayerDim(net); i++)
+        u32 nBatch = Min(NN_BATCH_SIZE, nTest - iTest);
+        for (u32 b = 0; b < nBatch; b++)
+            images[b] = net.nTrainImages + iTest + b;
+        f32 *outputs = FeedForwardBatch(net, images, nBatch);
+        for (u32 b = 0; b < nBatch; b++)
         {
-            if (output[i] > output[classify])
-                classify = i;
+            f32 *output = outputs + b * outDim;
+            u32 classify = 0;
+            for (u32 i = 1; i < outDim; i++)
+            {
+                if (output[i] > output[classify])
+                    classify = i;
+            }
+            if (classify == testData.labels[iTest + b])
+                nSuccess++;
         }
-        if (classify == testData.labels[iTest])
-            nSuccess++;
         
-        if (iTest % 1000 == 0)
+        if (iTest % (NN_BATCH_SIZE * 16) == 0)
             Print("Processed " << iTest << '/' << nTest << '\n');
     }
     TimeEnd();
@@ -4,6 +4,28 @@
 #define NEURAL_NET_H
 
 #include "data.h"
+#include "file_mapping.h"
+
+// NOTE(heyyod): Picked at runtime by CreateNeuralNet. The cpu keeps the buffers in host
+// memory with the same layout as the vulkan buffers, so the layer indices work for both.
+enum nn_backend
+{
+    NN_BACKEND_GPU,
+    NN_BACKEND_CPU,
+};
+
+// NOTE(heyyod): Images that go through FeedForwardBatch at once, also the largest mini-batch
+// of TrainNeuralNet
+#define NN_BATCH_SIZE 64
+
+struct nn_train_options
+{
+    f32 learningRate;
+    u32 batchSize;       // images per weight update, at most NN_BATCH_SIZE
+    u32 nEpochs;         // most passes over the training images
+    f32 validationSplit; // part of the training images held out for validation
+    u32 patience;        // epochs without a lower validation loss before stopping
+};
 
 struct layer
 {
@@ -19,11 +41,81 @@ struct layer
 struct neural_net
 {
     u32 nLayers;
+    u32 nTrainImages; // the test images come after the training images in the input layer
+    u32 nWeights;
+    u32 nBiases;
+    nn_backend backend;
+    u64 trainDataChecksum; // ImageDataChecksum of the training data, goes into the saved models
+    
+    layer *layers;
+    
+    // NOTE(heyyod): Only used by the gpu backend, where values, weights, biases and errors live
+    // in device memory. output is host visible, the output values of a FeedForwardBatch are
+    // read back to it.
+    f32 *output;
+    
+    // NOTE(heyyod): Only used by the cpu backend. The input layer is read in place from the
+    // normalized pixels of the train and test data, so those have to outlive the net.
+    f32 *inputs[2];        // train, test
+    f32 *ownedInputs[2];   // normalized copies, when the data had no normalizedPixels
     f32 *weights;
     f32 *biases;
-    f32 *values;
-    f32 *errors;
-    layer *layers;
+    
+    // NOTE(heyyod): [NN_BATCH_SIZE x dim] values and errors of every layer after the input one,
+    // see FeedForwardBatch and BackPropagateBatch. The gpu buffers have the same layout after
+    // the input images, see LayerGpuValuesIndex.
+    f32 *batchValues;
+    f32 *batchErrors;
+};
+
+// NOTE(heyyod): Trained weights and biases, written by SaveNeuralNet:
+//   header | layer table (nn_model_layer, nLayers) | weights (f32) | biases (f32)
+// The weights and biases have the same layout as the neural_net buffers. Every section
+// starts at a multiple of NN_MODEL_ALIGNMENT and is zero padded up to the next one, so a
+// mapped file can be used in place. The checksum covers everything after the header.
+// datasetChecksum is the ImageDataChecksum of the images the model was trained on, a net
+// only loads a model of its own training data.
+#define NN_MODEL_MAGIC 0x4E4E5948 // "HYNN"
+#define NN_MODEL_VERSION 2
+#define NN_MODEL_ALIGNMENT 64
+#define NN_MODEL_MAX_LAYERS 64
+#define NN_MODEL_FILEPATH "../build/mnist.model"
+
+struct nn_model_layer
+{
+    u32 dimension;
+    u32 weightsDim;   // 0 for the input layer
+    u32 weightsIndex; // index in the weights section
+    u32 biasesIndex;  // index in the biases section
+};
+
+struct nn_model_header
+{
+    u32 magic;
+    u32 version;
+    u32 headerSize;
+    u32 nLayers;
+    u32 nWeights;
+    u32 nBiases;
+    u64 fileSize;
+    u64 checksum;
+    u64 datasetChecksum;
+    u64 layersOffset;
+    u64 weightsOffset;
+    u64 biasesOffset;
+};
+
+// NOTE(heyyod): Every pointer points into the read only mapping of the model file
+struct nn_model
+{
+    u32 nLayers;
+    u32 nWeights;
+    u32 nBiases;
+    u64 datasetChecksum;
+    nn_model_layer *layers;
+    f32 *weights;
+    f32 *biases;
+    mapped_file file;
 };
 
 #define LayerValuesIndex(net, l)    (net.layers[l].valuesIndex)
@@ -33,10 +125,11 @@ struct neural_net
 #define LayerWeightsDim(net, l)     (net.layers[l].weightsDim)
 #define LayerDim(net, l)            (net.layers[l].dimension)
 #define LayerDepth(net, l)          (net.layers[l].depth)
-#define LayerValues(net, l)         (&net.values[net.layers[l].valuesIndex])
-#define LayerErrors(net, l)         (&net.errors[net.layers[l].errorsIndex])
-#define OutputLayerValues(net)      LayerValues(net, net.nLayers - 1)
-#define OutputLayerErrors(net)      LayerErrors(net, net.nLayers - 1)
+#define OutputLayerValues(net)      (net.output)
 #define OutputLayerDim(net)         LayerDim(net, net.nLayers - 1)
+#define LayerBatchOffset(net, l)    (NN_BATCH_SIZE * (net.layers[l].valuesIndex - net.layers[1].valuesIndex))
+#define LayerBatchValues(net, l)    (&net.batchValues[LayerBatchOffset(net, l)])
+#define LayerGpuValuesIndex(net, l) (net.layers[1].valuesIndex + LayerBatchOffset(net, l))
+#define LayerBatchErrors(net, l)    (&net.batchErrors[NN_BATCH_SIZE * net.layers[l].errorsIndex])
 
 #endif //NEURAL_NET_H
@@ -0,0 +1,174 @@
+#include "neural_net.h"
+
+// NOTE(heyyod): Inference only, on the cpu. The engine reads the weights and biases straight
+// from the mapped model file and never writes to anything it owns, so any number of threads
+// can run Infer at the same time as long as each one passes its own scratch.
+
+// NOTE(heyyod): Images per pass through the layers. Every block of weight rows is reused by
+// this many images while it is in the cache, and the scratch grows with it.
+#define NN_INFER_BATCH_SIZE 16
+
+struct nn_inference_engine
+{
+    nn_model model;
+    u32 inputDim;
+    u32 nClasses;
+    u32 maxDim; // largest layer dimension
+};
+
+// NOTE(heyyod): Two [NN_INFER_BATCH_SIZE x maxDim] buffers that the layers ping pong between
+struct nn_inference_scratch
+{
+    f32 *memory;
+};
+
+func bool
+CreateInferenceEngine(char *modelFilepath, nn_inference_engine &engineOut)
+{
+    engineOut = {};
+    if (!MapNeuralNetModel(modelFilepath, engineOut.model))
+        return false;
+
+    nn_model &model = engineOut.model;
+    engineOut.inputDim = model.layers[0].dimension;
+    engineOut.nClasses = model.layers[model.nLayers - 1].dimension;
+    for (u32 i = 0; i < model.nLayers; i++)
+        engineOut.maxDim = Max(engineOut.maxDim, model.layers[i].dimension);
+    InitNeuralNetKernels();
+    return true;
+}
+
+func void
+DestroyInferenceEngine(nn_inference_engine &engine)
+{
+    UnmapNeuralNetModel(engine.model);
+    engine = {};
+}
+
+func bool
+CreateInferenceScratch(nn_inference_engine &engine, nn_inference_scratch &scratchOut)
+{
+    scratchOut.memory = (f32 *)malloc(2 * NN_INFER_BATCH_SIZE * (u64)engine.maxDim * sizeof(f32));
+    return scratchOut.memory != 0;
+}
+
+func void
+FreeInferenceScratch(nn_inference_scratch &scratch)
+{
+    free(scratch.memory);
+    scratch = {};
+}
+
+// NOTE(heyyod): pixels holds nImages images of inputDim u8 pixels. probabilitiesOut gets
+// nClasses values per image: the sigmoid outputs of the net scaled to add up to 1.
+func void
+Infer(nn_inference_engine &engine, nn_inference_scratch &scratch, u8 *pixels, u32 nImages, f32 *probabilitiesOut)
+{
+    nn_model &model = engine.model;
+    f32 *buffers[2] = {scratch.memory, scratch.memory + NN_INFER_BATCH_SIZE * (u64)engine.maxDim};
+    for (u32 iImage = 0; iImage < nImages; iImage += NN_INFER_BATCH_SIZE)
+    {
+        u32 nBatch = Min(NN_INFER_BATCH_SIZE, nImages - iImage);
+
+        nn_feed_forward_job job = {};
+        job.nInputs = nBatch;
+        job.inDim = engine.inputDim;
+        for (u32 b = 0; b < nBatch; b++)
+        {
+            u8 *img = &pixels[(u64)(iImage + b) * engine.inputDim];
+            job.in[b] = buffers[0] + b * engine.inputDim;
+            for (u32 i = 0; i < engine.inputDim; i++)
+                job.in[b][i] = (f32)img[i] / 255.0f;
+        }
+
+        for (u32 iLayer = 1; iLayer < model.nLayers; iLayer++)
+        {
+            nn_model_layer &curr = model.layers[iLayer];
+            job.weights = &model.weights[curr.weightsIndex];
+            job.biases = &model.biases[curr.biasesIndex];
+            job.out = buffers[iLayer % 2];
+            job.outDim = curr.dimension;
+            for (u32 row = 0; row < job.outDim; row += NN_CPU_BLOCK_ROWS)
+                FeedForwardWork(&job, row, Min(row + NN_CPU_BLOCK_ROWS, job.outDim), 0);
+
+            job.inDim = job.outDim;
+            for (u32 b = 0; b < nBatch; b++)
+                job.in[b] = job.out + b * job.outDim;
+        }
+
+        for (u32 b = 0; b < nBatch; b++)
+        {
+            f32 *output = job.in[b];
+            f32 *probabilities = &probabilitiesOut[(u64)(iImage + b) * engine.nClasses];
+            f32 sum = 0.0f;
+            for (u32 i = 0; i < engine.nClasses; i++)
+                sum += output[i];
+            for (u32 i = 0; i < engine.nClasses; i++)
+                probabilities[i] = (sum > 0.0f) ? output[i] / sum : 1.0f / engine.nClasses;
+        }
+    }
+}
+
+struct nn_inference_test_job
+{
+    nn_inference_engine *engine;
+    nn_inference_scratch *scratches; // one per thread
+    image_data *testData;
+    f32 *probabilities;
+};
+
+func void
+InferenceTestWork(void *data, u32 begin, u32 end, u32 threadIndex)
+{
+    nn_inference_test_job &job = *(nn_inference_test_job *)data;
+    u32 inputDim = job.engine->inputDim;
+    Infer(*job.engine, job.scratches[threadIndex], &job.testData->pixels[(u64)begin * inputDim], end - begin,
+          &job.probabilities[(u64)begin * job.engine->nClasses]);
+}
+
+// NOTE(heyyod): Classifies the test images with the engine from every thread of the pool,
+// each thread with its own scratch
+func void
+TestInferenceEngine(nn_inference_engine &engine, image_data &testData)
+{
+    Print("\n---- Testing Inference Engine ----\n");
+    Assert(testData.pixelsPerImg == engine.inputDim);
+    InitThreadPool();
+
+    nn_inference_test_job job = {};
+    job.engine = &engine;
+    job.testData = &testData;
+    job.scratches = (nn_inference_scratch *)calloc(threadPool.nThreads, sizeof(nn_inference_scratch));
+    job.probabilities = (f32 *)malloc((u64)testData.nImages * engine.nClasses * sizeof(f32));
+    bool allocated = job.probabilities != 0;
+    for (u32 i = 0; i < threadPool.nThreads; i++)
+        allocated = CreateInferenceScratch(engine, job.scratches[i]) && allocated;
+
+    if (allocated)
+    {
+        TimeStart();
+        ParallelFor(testData.nImages, NN_INFER_BATCH_SIZE * 4, InferenceTestWork, &job);
+        TimeEnd();
+
+        u32 nSuccess = 0;
+        for (u32 iImage = 0; iImage < testData.nImages; iImage++)
+        {
+            f32 *probabilities = &job.probabilities[(u64)iImage * engine.nClasses];
+            u32 classify = 0;
+            for (u32 i = 1; i < engine.nClasses; i++)
+            {
+                if (probabilities[i] > probabilities[classify])
+                    classify = i;
+            }
+            if (classify == testData.labels[iImage])
+                nSuccess++;
+        }
+        std::cout << "Success rate: " << (f32)nSuccess / (f32)testData.nImages << std::endl;
+        PrintTimeElapsed();
+    }
+
+    for (u32 i = 0; i < threadPool.nThreads; i++)
+        FreeInferenceScratch(job.scratches[i]);
+    free(job.scratches);
+    free(job.probabilities);
+}
@@ -0,0 +1,232 @@
+#include "cpu_features.h"
+
+// NOTE(heyyod): f32 kernels of the cpu neural net. Every instruction set has its own
+// version and InitNeuralNetKernels picks the best one the cpu supports at runtime.
+
+// NOTE(heyyod): Dot products of x with NN_DOT_ROWS rows of a weight matrix that are stride
+// floats apart. Loading x once for 4 rows is what keeps the feed forward from being bound by
+// the loads of x, and it is the register block of the blocked matrix product.
+#define NN_DOT_ROWS 4
+typedef void dot_rows_kernel(f32 *x, f32 *w, u32 count, u32 stride, f32 *dotsOut);
+
+// NOTE(heyyod): y += a * x
+typedef void axpy_kernel(f32 a, f32 *x, f32 *y, u32 count);
+
+// NOTE(heyyod): y += a[0] * rows[0] + ... + a[3] * rows[3]. y is loaded and stored once for
+// NN_DOT_ROWS rows, it is the register block of the mini-batch back propagation products.
+typedef void axpy_rows_kernel(f32 *a, f32 **rows, f32 *y, u32 count);
+
+struct nn_kernels
+{
+    dot_rows_kernel *dotRows;
+    axpy_kernel *axpy;
+    axpy_rows_kernel *axpyRows;
+    char *name;
+};
+
+global_var nn_kernels nnKernels;
+
+//-----------------------------------------------------
+//            Scalar
+//-----------------------------------------------------
+func void
+DotRowsScalar(f32 *x, f32 *w, u32 count, u32 stride, f32 *dotsOut)
+{
+    for (u32 r = 0; r < NN_DOT_ROWS; r++)
+    {
+        f32 dot = 0.0f;
+        for (u32 i = 0; i < count; i++)
+            dot += x[i] * w[r * stride + i];
+        dotsOut[r] = dot;
+    }
+}
+
+func void
+AxpyScalar(f32 a, f32 *x, f32 *y, u32 count)
+{
+    for (u32 i = 0; i < count; i++)
+        y[i] += a * x[i];
+}
+
+func void
+AxpyRowsScalar(f32 *a, f32 **rows, f32 *y, u32 count)
+{
+    for (u32 i = 0; i < count; i++)
+        y[i] += a[0] * rows[0][i] + a[1] * rows[1][i] + a[2] * rows[2][i] + a[3] * rows[3][i];
+}
+
+//-----------------------------------------------------
+//            AVX2 + FMA
+//-----------------------------------------------------
+TARGET_AVX2_FMA func f32
+HorizontalAddAVX2(__m256 v)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+TARGET_AVX2_FMA func void
+DotRowsAVX2(f32 *x, f32 *w, u32 count, u32 stride, f32 *dotsOut)
+{
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    __m256 sum2 = _mm256_setzero_ps();
+    __m256 sum3 = _mm256_setzero_ps();
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        sum0 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(w + 0 * stride + i), sum0);
+        sum1 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(w + 1 * stride + i), sum1);
+        sum2 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(w + 2 * stride + i), sum2);
+        sum3 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(w + 3 * stride + i), sum3);
+    }
+    dotsOut[0] = HorizontalAddAVX2(sum0);
+    dotsOut[1] = HorizontalAddAVX2(sum1);
+    dotsOut[2] = HorizontalAddAVX2(sum2);
+    dotsOut[3] = HorizontalAddAVX2(sum3);
+    for (; i < count; i++)
+    {
+        for (u32 r = 0; r < NN_DOT_ROWS; r++)
+            dotsOut[r] += x[i] * w[r * stride + i];
+    }
+}
+
+TARGET_AVX2_FMA func void
+AxpyAVX2(f32 a, f32 *x, f32 *y, u32 count)
+{
+    __m256 va = _mm256_set1_ps(a);
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    for (; i < count; i++)
+        y[i] += a * x[i];
+}
+
+TARGET_AVX2_FMA func void
+AxpyRowsAVX2(f32 *a, f32 **rows, f32 *y, u32 count)
+{
+    __m256 a0 = _mm256_set1_ps(a[0]);
+    __m256 a1 = _mm256_set1_ps(a[1]);
+    __m256 a2 = _mm256_set1_ps(a[2]);
+    __m256 a3 = _mm256_set1_ps(a[3]);
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 sum = _mm256_loadu_ps(y + i);
+        sum = _mm256_fmadd_ps(a0, _mm256_loadu_ps(rows[0] + i), sum);
+        sum = _mm256_fmadd_ps(a1, _mm256_loadu_ps(rows[1] + i), sum);
+        sum = _mm256_fmadd_ps(a2, _mm256_loadu_ps(rows[2] + i), sum);
+        sum = _mm256_fmadd_ps(a3, _mm256_loadu_ps(rows[3] + i), sum);
+        _mm256_storeu_ps(y + i, sum);
+    }
+    for (; i < count; i++)
+        y[i] += a[0] * rows[0][i] + a[1] * rows[1][i] + a[2] * rows[2][i] + a[3] * rows[3][i];
+}
+
+//-----------------------------------------------------
+//            AVX-512
+//-----------------------------------------------------
+// NOTE(heyyod): Not _mm512_reduce_add_ps, see HorizontalAddAVX512 in distance_kernels.cpp
+TARGET_AVX512BW func f32
+HorizontalAddAVX512(__m512 v)
+{
+    __m512d d = _mm512_castps_pd(v);
+    __m256 sum256 = _mm256_add_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, d, 0)),
+                                  _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, d, 1)));
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum256), _mm256_extractf128_ps(sum256, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+TARGET_AVX512BW func void
+DotRowsAVX512(f32 *x, f32 *w, u32 count, u32 stride, f32 *dotsOut)
+{
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    __m512 sum2 = _mm512_setzero_ps();
+    __m512 sum3 = _mm512_setzero_ps();
+    u32 i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512 vx = _mm512_loadu_ps(x + i);
+        sum0 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(w + 0 * stride + i), sum0);
+        sum1 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(w + 1 * stride + i), sum1);
+        sum2 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(w + 2 * stride + i), sum2);
+        sum3 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(w + 3 * stride + i), sum3);
+    }
+    dotsOut[0] = HorizontalAddAVX512(sum0);
+    dotsOut[1] = HorizontalAddAVX512(sum1);
+    dotsOut[2] = HorizontalAddAVX512(sum2);
+    dotsOut[3] = HorizontalAddAVX512(sum3);
+    for (; i < count; i++)
+    {
+        for (u32 r = 0; r < NN_DOT_ROWS; r++)
+            dotsOut[r] += x[i] * w[r * stride + i];
+    }
+}
+
+TARGET_AVX512BW func void
+AxpyAVX512(f32 a, f32 *x, f32 *y, u32 count)
+{
+    __m512 va = _mm512_set1_ps(a);
+    u32 i = 0;
+    for (; i + 16 <= count; i += 16)
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    for (; i < count; i++)
+        y[i] += a * x[i];
+}
+
+TARGET_AVX512BW func void
+AxpyRowsAVX512(f32 *a, f32 **rows, f32 *y, u32 count)
+{
+    __m512 a0 = _mm512_set1_ps(a[0]);
+    __m512 a1 = _mm512_set1_ps(a[1]);
+    __m512 a2 = _mm512_set1_ps(a[2]);
+    __m512 a3 = _mm512_set1_ps(a[3]);
+    u32 i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512 sum = _mm512_loadu_ps(y + i);
+        sum = _mm512_fmadd_ps(a0, _mm512_loadu_ps(rows[0] + i), sum);
+        sum = _mm512_fmadd_ps(a1, _mm512_loadu_ps(rows[1] + i), sum);
+        sum = _mm512_fmadd_ps(a2, _mm512_loadu_ps(rows[2] + i), sum);
+        sum = _mm512_fmadd_ps(a3, _mm512_loadu_ps(rows[3] + i), sum);
+        _mm512_storeu_ps(y + i, sum);
+    }
+    for (; i < count; i++)
+        y[i] += a[0] * rows[0][i] + a[1] * rows[1][i] + a[2] * rows[2][i] + a[3] * rows[3][i];
+}
+
+func void
+InitNeuralNetKernels()
+{
+    if (nnKernels.dotRows)
+        return;
+
+    cpu_features features = GetCpuFeatures();
+    if (features.avx512bw)
+    {
+        nnKernels.dotRows = DotRowsAVX512;
+        nnKernels.axpy = AxpyAVX512;
+        nnKernels.axpyRows = AxpyRowsAVX512;
+        nnKernels.name = "AVX-512";
+    }
+    else if (features.avx2 && features.fma)
+    {
+        nnKernels.dotRows = DotRowsAVX2;
+        nnKernels.axpy = AxpyAVX2;
+        nnKernels.axpyRows = AxpyRowsAVX2;
+        nnKernels.name = "AVX2+FMA";
+    }
+    else
+    {
+        nnKernels.dotRows = DotRowsScalar;
+        nnKernels.axpy = AxpyScalar;
+        nnKernels.axpyRows = AxpyRowsScalar;
+        nnKernels.name = "Scalar";
+    }
+}
@@ -0,0 +1,158 @@
+/* date = October 17th 2026 10:12 am */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// NOTE(heyyod): A job is split into chunks of [begin, end) indices. Every thread grabs the
+// next chunk from an atomic counter until the job is exhausted. threadIndex is in
+// [0, threadPool.nThreads) and can be used to index per thread scratch memory.
+// The calling thread always runs as thread 0.
+typedef void parallel_work(void *data, u32 begin, u32 end, u32 threadIndex);
+
+struct thread_pool
+{
+    u32 nThreads; // workers + the calling thread
+    std::thread *workers;
+
+    std::mutex jobMutex; // serializes ParallelFor calls from different threads
+    std::mutex mutex;
+    std::condition_variable workReady;
+    std::condition_variable workDone;
+
+    parallel_work *work;
+    void *workData;
+    u32 workCount;
+    u32 chunkSize;
+    std::atomic<u32> nextIndex;
+
+    u32 generation;
+    u32 nBusy;
+    bool quit;
+};
+
+global_var thread_pool threadPool;
+
+func void
+RunWorkChunks(u32 threadIndex)
+{
+    for (;;)
+    {
+        u32 begin = threadPool.nextIndex.fetch_add(threadPool.chunkSize);
+        if (begin >= threadPool.workCount)
+            break;
+        u32 end = Min(begin + threadPool.chunkSize, threadPool.workCount);
+        threadPool.work(threadPool.workData, begin, end, threadIndex);
+    }
+}
+
+func void
+ThreadPoolWorker(u32 threadIndex)
+{
+    u32 seenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(threadPool.mutex);
+            threadPool.workReady.wait(lock, [&]{ return threadPool.quit || threadPool.generation != seenGeneration; });
+            if (threadPool.quit)
+                return;
+            seenGeneration = threadPool.generation;
+        }
+
+        RunWorkChunks(threadIndex);
+
+        {
+            std::lock_guard<std::mutex> lock(threadPool.mutex);
+            // NOTE(heyyod): Every worker checks in for every job, so a new job can't
+            // start before all workers have seen the previous one.
+            if (--threadPool.nBusy == 0)
+                threadPool.workDone.notify_one();
+        }
+    }
+}
+
+// NOTE(heyyod): nThreads = 0 uses all the hardware threads
+func void
+InitThreadPool(u32 nThreads = 0)
+{
+    if (threadPool.nThreads)
+        return;
+
+    if (nThreads == 0)
+        nThreads = std::thread::hardware_concurrency();
+    if (nThreads == 0)
+        nThreads = 1;
+
+    threadPool.nThreads = nThreads;
+    threadPool.quit = false;
+    threadPool.generation = 0;
+    threadPool.nBusy = 0;
+
+    if (nThreads > 1)
+    {
+        threadPool.workers = new std::thread[nThreads - 1];
+        for (u32 i = 0; i < nThreads - 1; i++)
+            threadPool.workers[i] = std::thread(ThreadPoolWorker, i + 1);
+    }
+    DebugPrint("Created thread pool with " << nThreads << " threads\n");
+}
+
+func void
+DestroyThreadPool()
+{
+    if (threadPool.nThreads > 1)
+    {
+        {
+            std::lock_guard<std::mutex> lock(threadPool.mutex);
+            threadPool.quit = true;
+        }
+        threadPool.workReady.notify_all();
+        for (u32 i = 0; i < threadPool.nThreads - 1; i++)
+            threadPool.workers[i].join();
+        delete[] threadPool.workers;
+        threadPool.workers = 0;
+    }
+    threadPool.nThreads = 0;
+}
+
+// NOTE(heyyod): Blocks until every index in [0, count) has been processed.
+// Don't call it from inside a parallel_work callback, the pool is not reentrant.
+func void
+ParallelFor(u32 count, u32 chunkSize, parallel_work *work, void *data)
+{
+    if (count == 0)
+        return;
+    if (chunkSize == 0)
+        chunkSize = 1;
+
+    if (threadPool.nThreads <= 1)
+    {
+        for (u32 begin = 0; begin < count; begin += chunkSize)
+            work(data, begin, Min(begin + chunkSize, count), 0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> jobLock(threadPool.jobMutex);
+    {
+        std::lock_guard<std::mutex> lock(threadPool.mutex);
+        threadPool.work = work;
+        threadPool.workData = data;
+        threadPool.workCount = count;
+        threadPool.chunkSize = chunkSize;
+        threadPool.nextIndex = 0;
+        threadPool.nBusy = threadPool.nThreads - 1;
+        threadPool.generation++;
+    }
+    threadPool.workReady.notify_all();
+
+    RunWorkChunks(0);
+
+    std::unique_lock<std::mutex> lock(threadPool.mutex);
+    threadPool.workDone.wait(lock, []{ return threadPool.nBusy == 0; });
+}
+
+#endif //THREAD_POOL_H
@@ -0,0 +1,127 @@
+/* date = October 17th 2026 6:05 pm */
+
+#ifndef TOP_K_H
+#define TOP_K_H
+
+// NOTE(heyyod): Keeps the k smallest distances seen so far together with an id
+// (a label or an image index). The memory is owned by the caller so a whole set of
+// lists can live in one allocation.
+//
+// TOP_K_SORTED keeps the entries sorted and inserts by shifting. For small k the
+// shift stays in a cache line or two and beats the heap.
+// TOP_K_HEAP keeps a binary max-heap so an insert is O(log k). Use it for the large
+// k of soft voting.
+//
+// Bound() is the distance a new entry has to beat, so hot loops can skip
+// the call for most candidates.
+enum top_k_policy
+{
+    TOP_K_SORTED,
+    TOP_K_HEAP,
+};
+
+// NOTE(heyyod): Up to this k the sorted insertion is faster
+#define TOP_K_SORTED_MAX 16
+
+template <top_k_policy Policy>
+struct top_k
+{
+    u32 capacity;
+    u32 count;
+    u32 *dists;
+    u32 *ids;
+
+    inline u32 Bound()
+    {
+        if (count < capacity)
+            return U32_MAX;
+        return (Policy == TOP_K_HEAP) ? dists[0] : dists[count - 1];
+    }
+};
+
+template <top_k_policy Policy> inline void
+InitTopK(top_k<Policy> &topK, u32 capacity, u32 *dists, u32 *ids)
+{
+    topK.capacity = capacity;
+    topK.count = 0;
+    topK.dists = dists;
+    topK.ids = ids;
+}
+
+template <top_k_policy Policy> inline void
+ResetTopK(top_k<Policy> &topK)
+{
+    topK.count = 0;
+}
+
+inline void
+TopKInsert(top_k<TOP_K_SORTED> &topK, u32 dist, u32 id)
+{
+    if (dist >= topK.Bound())
+        return;
+
+    u32 i = (topK.count < topK.capacity) ? topK.count++ : topK.count - 1;
+    while (i > 0 && topK.dists[i - 1] > dist)
+    {
+        topK.dists[i] = topK.dists[i - 1];
+        topK.ids[i] = topK.ids[i - 1];
+        i--;
+    }
+    topK.dists[i] = dist;
+    topK.ids[i] = id;
+}
+
+inline void
+TopKInsert(top_k<TOP_K_HEAP> &topK, u32 dist, u32 id)
+{
+    if (dist >= topK.Bound())
+        return;
+
+    u32 *dists = topK.dists;
+    u32 *ids = topK.ids;
+    if (topK.count < topK.capacity)
+    {
+        // NOTE(heyyod): Sift up from the new leaf
+        u32 i = topK.count++;
+        while (i > 0)
+        {
+            u32 parent = (i - 1) / 2;
+            if (dists[parent] >= dist)
+                break;
+            dists[i] = dists[parent];
+            ids[i] = ids[parent];
+            i = parent;
+        }
+        dists[i] = dist;
+        ids[i] = id;
+    }
+    else
+    {
+        // NOTE(heyyod): Replace the furthest (the root) and sift down
+        u32 i = 0;
+        for (;;)
+        {
+            u32 child = 2 * i + 1;
+            if (child >= topK.count)
+                break;
+            if (child + 1 < topK.count && dists[child + 1] > dists[child])
+                child++;
+            if (dists[child] <= dist)
+                break;
+            dists[i] = dists[child];
+            ids[i] = ids[child];
+            i = child;
+        }
+        dists[i] = dist;
+        ids[i] = id;
+    }
+}
+
+template <top_k_policy Policy> inline void
+MergeTopK(top_k<Policy> &dest, top_k<Policy> &src)
+{
+    for (u32 i = 0; i < src.count; i++)
+        TopKInsert(dest, src.dists[i], src.ids[i]);
+}
+
+#endif //TOP_K_H
@@ -111,6 +111,7 @@ VulkanDeclareFunction(vkCreateFence);
 VulkanDeclareFunction(vkResetFences);
 VulkanDeclareFunction(vkDestroyFence);
 VulkanDeclareFunction(vkWaitForFences);
+VulkanDeclareFunction(vkGetFenceStatus);
 VulkanDeclareFunction(vkCreateShaderModule);
 VulkanDeclareFunction(vkDestroyShaderModule);
 VulkanDeclareFunction(vkCreatePipelineLayout);
@@ -131,12 +132,20 @@ VulkanDeclareFunction(vkDestroyDescriptorPool);
 VulkanDeclareFunction(vkAllocateDescriptorSets);
 VulkanDeclareFunction(vkUpdateDescriptorSets);
 VulkanDeclareFunction(vkCreateComputePipelines);
+VulkanDeclareFunction(vkCreatePipelineCache);
+VulkanDeclareFunction(vkDestroyPipelineCache);
+VulkanDeclareFunction(vkGetPipelineCacheData);
 
 VulkanDeclareFunction(vkCmdPipelineBarrier);
 VulkanDeclareFunction(vkCmdBindPipeline);
 VulkanDeclareFunction(vkCmdBindDescriptorSets);
 VulkanDeclareFunction(vkCmdPushConstants);
 VulkanDeclareFunction(vkCmdDispatch);
+VulkanDeclareFunction(vkCreateQueryPool);
+VulkanDeclareFunction(vkDestroyQueryPool);
+VulkanDeclareFunction(vkGetQueryPoolResults);
+VulkanDeclareFunction(vkCmdResetQueryPool);
+VulkanDeclareFunction(vkCmdWriteTimestamp);
 VulkanDeclareFunction(vkCmdCopyBuffer);
 
 #define VulkanLoadDeviceFunc(funcName)                                         \
@@ -169,6 +178,7 @@ VulkanLoadDeviceFunctions()
     VulkanLoadDeviceFunc(vkDestroyFence);
     VulkanLoadDeviceFunc(vkWaitForFences);
     VulkanLoadDeviceFunc(vkResetFences);
+    VulkanLoadDeviceFunc(vkGetFenceStatus);
     VulkanLoadDeviceFunc(vkCreateShaderModule);
     VulkanLoadDeviceFunc(vkDestroyShaderModule);
     VulkanLoadDeviceFunc(vkCreatePipelineLayout);
@@ -189,12 +199,20 @@ VulkanLoadDeviceFunctions()
     VulkanLoadDeviceFunc(vkAllocateDescriptorSets);
     VulkanLoadDeviceFunc(vkUpdateDescriptorSets);
     VulkanLoadDeviceFunc(vkCreateComputePipelines);
+    VulkanLoadDeviceFunc(vkCreatePipelineCache);
+    VulkanLoadDeviceFunc(vkDestroyPipelineCache);
+    VulkanLoadDeviceFunc(vkGetPipelineCacheData);
     
     VulkanLoadDeviceFunc(vkCmdPipelineBarrier);
     VulkanLoadDeviceFunc(vkCmdBindPipeline);
     VulkanLoadDeviceFunc(vkCmdBindDescriptorSets);
     VulkanLoadDeviceFunc(vkCmdPushConstants);
     VulkanLoadDeviceFunc(vkCmdDispatch);
+    VulkanLoadDeviceFunc(vkCreateQueryPool);
+    VulkanLoadDeviceFunc(vkDestroyQueryPool);
+    VulkanLoadDeviceFunc(vkGetQueryPoolResults);
+    VulkanLoadDeviceFunc(vkCmdResetQueryPool);
+    VulkanLoadDeviceFunc(vkCmdWriteTimestamp);
     VulkanLoadDeviceFunc(vkCmdCopyBuffer);
     
     DebugPrint("Loaded Device Functions\n");
@@ -6,23 +6,45 @@ namespace Vulkan
     func bool Initialize();
     
     func bool CreatePipeline(pipeline_type pipelineType);
+    func bool CreateStorageBufferSet(u32 nBuffers, VkDescriptorSetLayout &layoutOut, VkDescriptorSet &setOut);
+    func void WriteStorageBufferSet(vulkan_buffer **buffers, u32 nBuffers, vulkan_pipeline &pipeline);
+    func void LoadPipelineCache();
+    func void SavePipelineCache();
     func bool CreateBuffer(VkBufferUsageFlags usage, u64 size, VkMemoryPropertyFlags properties,  vulkan_buffer &bufferOut, bool mapBuffer);
     
-    func bool UploadInputData(void *testData, void *trainData);
-    func bool AllocateKnnMemory(u32 **distPerImgData, u64 &distPerImgDataSize);
-    func bool AllocateNeuralNetMemory(u32* layersDims, u32 nLayers, f32 **outWeights, f32 **outBiases, f32 **outValues, f32 **outErrors, f32 **outProducts);
-    func void GetGroupCountAndBatches(u32 totalInvocations, u32 groupSize, u32 &groupCount, u32 &batches);
+    func bool CopyBuffer(vulkan_buffer &src, u64 srcOffset, vulkan_buffer &dst, u64 dstOffset, u64 size);
+    func bool CreateStagingBuffer(u64 size, vulkan_buffer &stagingOut);
+    func bool UploadBuffer(vulkan_buffer &dst, u64 dstOffset, void *data, u64 size);
+    func bool DownloadBuffer(vulkan_buffer &src, u64 srcOffset, void *dataOut, u64 size);
+    func bool UploadKnnPixels(u8 *trainPixels, u32 nTrainImages, u8 *testPixels, u32 nTestImages, u32 pixelsPerImg);
+    func bool AllocateKnnMemory(u32 nTrainImages, bool readBackDistances);
+    func void FreeKnnCommands();
+    func bool AllocateNeuralNetMemory(u32* layersDims, u32 nLayers, u32 nInputImages, u32 batchSize, f32 **outOutputValues);
     
     func void ClearPipelinesAndStorageBuffers();
     func void ClearBuffer(vulkan_buffer &buffer);
     func void Destroy();
     
-    func bool KnnCompute(u32 &testImageIndex, u32 distP);
-    func bool FeedForwardCompute(u32 inValuesIndex, u32 inValuesDim, u32 weightsIndex, u32 weightsDim, u32 biasesIndex, u32 outValuesIndex, u32 outValuesDim);
-    func bool BackPropagateCompute(u32 currLayerValuesIndex, u32 prevLayerValuesIndex, u32 inErrorsIndex, u32 inErrorsDim, u32 weightsIndex, u32 weightsDim, u32 biasesIndex, u32 outErrorsIndex, u32 outErrorsDim, f32 learningRate, u32 layerIndex);
+    func bool RecordKnnCommands(VkCommandBuffer cmdBuffer, u32 slot, u32 nTests);
+    func bool KnnSubmit(u32 slot, u32 firstTestIndex, u32 nTests, u32 distP, u32 nTrainImages, u32 wordsPerImage, u32 k);
+    func bool KnnWait(u32 slot);
+    func void KnnPoll();
+    func u32 *KnnSlotDistances(u32 slot);
+    func gpu_neighbour *KnnSlotNeighbours(u32 slot);
+    func bool BeginNeuralNetCommands(u32 *images, u32 *labels, u32 nImages);
+    func void FeedForwardCompute(push_constants_feed_forward *layers, u32 nLayers, u32 nImages);
+    func void BackPropagateCompute(push_constants_back_propagate *layers, u32 nLayers);
+    func void CopyOutputCompute(u32 valuesIndex, u32 nValues);
+    func bool SubmitNeuralNetCommands();
+    func void CmdComputeBarrier(VkCommandBuffer cmdBuffer);
     
+    func void CmdTimestamp(VkCommandBuffer cmdBuffer, VkPipelineStageFlagBits stage, u32 query);
+    func void RecordGpuTimes(u32 firstQuery, u32 nPairs, profile_timer firstTimer);
     func bool LoadShader(char *filepath, VkShaderModule *shaderOut);
     func bool FindMemoryProperties(u32 memoryType, VkMemoryPropertyFlags requiredProperties, u32 &memoryIndexOut);
+    func bool AllocateBufferMemory(VkMemoryRequirements &memoryReq, VkMemoryPropertyFlags properties, bool mapBuffer, vulkan_buffer &buffer);
+    func void FreeBufferMemory(vulkan_buffer &buffer);
+    func void FreeMemoryBlocks();
     
 #if VULKAN_VALIDATION_LAYERS_ON
     func VKAPI_ATTR VkBool32 VKAPI_CALL
@@ -131,22 +153,47 @@ FindMemoryProperties(u32 reqMemType, VkMemoryPropertyFlags reqMemProperties, u32
     return false;
 }
 
-// TODO: make this cross-platform
 func bool Vulkan::
 LoadDLL()
 {
+#ifdef _WIN32
     vulkan.dll = LoadLibraryA("vulkan-1.dll");
     if (!vulkan.dll)
         return false;
     
     vkGetInstanceProcAddr = (vk_get_instance_proc_addr *)GetProcAddress(vulkan.dll, "vkGetInstanceProcAddr");
+#else
+    // NOTE(heyyod): libvulkan.so.1 is the loader's soname. The unversioned name only
+    // exists when the dev package is installed.
+    vulkan.dll = dlopen("libvulkan.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!vulkan.dll)
+        vulkan.dll = dlopen("libvulkan.so", RTLD_NOW | RTLD_LOCAL);
+    if (!vulkan.dll)
+        return false;
+    
+    vkGetInstanceProcAddr = (vk_get_instance_proc_addr *)dlsym(vulkan.dll, "vkGetInstanceProcAddr");
+#endif
+    if (!vkGetInstanceProcAddr)
+        return false;
     
     DebugPrint("Loaded DLL\n");
     return true;
 }
 
+// NOTE(heyyod): Discrete gpus first, software implementations (like lavapipe) last
+func u32
+GpuTypeScore(VkPhysicalDeviceType type)
+{
+    switch (type)
+    {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return 4;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return 3;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return 2;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: return 1;
+        default: return 0;
+    }
+}
 
-// TODO: Make it cross-platform
 func bool Vulkan::
 Initialize()
 {
@@ -292,33 +339,48 @@ Initialize()
         }
         
         AssertSuccess(vkEnumeratePhysicalDevices(vulkan.instance, &gpuCount, gpuBuffer));
+        
+        // NOTE(heyyod): KNN_VULKAN_DEVICE=<index> forces a device, eg. to benchmark against
+        // a software implementation on a machine that also has a gpu
+        char *forcedDevice = getenv("KNN_VULKAN_DEVICE");
+        u32 forcedIndex = forcedDevice ? (u32)atoi(forcedDevice) : UINT32_MAX;
+        
         vulkan.computeQueueFamilyIndex = UINT32_MAX;
-        for (u8 iGPU = 0; iGPU < gpuCount; iGPU++)
+        u32 bestScore = 0;
+        for (u32 iGPU = 0; iGPU < gpuCount; iGPU++)
         {
+            if (forcedIndex != UINT32_MAX && iGPU != forcedIndex)
+                continue;
+            
+            // NOTE: Pick a queue family the supports compute operations
+            u32 queueFamilyCount;
+            VkQueueFamilyProperties availableQueueFamilies[16] = {};
+            vkGetPhysicalDeviceQueueFamilyProperties(gpuBuffer[iGPU], &queueFamilyCount, 0);
+            queueFamilyCount = Min(queueFamilyCount, (u32)ArrayCount(availableQueueFamilies));
+            vkGetPhysicalDeviceQueueFamilyProperties(gpuBuffer[iGPU], &queueFamilyCount, availableQueueFamilies);
+            
+            u32 computeFamily = UINT32_MAX;
+            for (u32 i = 0; i < queueFamilyCount; ++i)
             {
-                // NOTE: Pick a queue family the supports compute operations
-                u32 queueFamilyCount;
-                VkQueueFamilyProperties availableQueueFamilies[16] = {};
-                vkGetPhysicalDeviceQueueFamilyProperties(gpuBuffer[iGPU], &queueFamilyCount, 0);
-                Assert(queueFamilyCount <= ArrayCount(availableQueueFamilies));
-                vkGetPhysicalDeviceQueueFamilyProperties(gpuBuffer[iGPU], &queueFamilyCount, availableQueueFamilies);
-                
-                for (u32 i = 0; i < queueFamilyCount; ++i)
+                if ((availableQueueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT) != 0)
                 {
-                    if ((availableQueueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT) != 0)
-                    {
-                        if (vulkan.computeQueueFamilyIndex == UINT32_MAX)
-                        {
-                            vulkan.gpu = gpuBuffer[iGPU];
-                            vulkan.computeQueueFamilyIndex = i;
-                            break;
-                        }
-                        
-                    }
+                    computeFamily = i;
+                    break;
                 }
             }
+            if (computeFamily == UINT32_MAX)
+                continue;
             
-            
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(gpuBuffer[iGPU], &properties);
+            u32 score = GpuTypeScore(properties.deviceType) + 1;
+            if (score > bestScore)
+            {
+                bestScore = score;
+                vulkan.gpu = gpuBuffer[iGPU];
+                vulkan.computeQueueFamilyIndex = computeFamily;
+                vulkan.timestampValidBits = availableQueueFamilies[computeFamily].timestampValidBits;
+            }
         }
         if (vulkan.computeQueueFamilyIndex == UINT32_MAX)
         {
@@ -329,8 +391,7 @@ Initialize()
         vkGetPhysicalDeviceProperties(vulkan.gpu, &vulkan.gpuProperties);
         vkGetPhysicalDeviceMemoryProperties(vulkan.gpu, &vulkan.memoryProperties);
         
-        
-        DebugPrint("Selected a GPU\n");
+        Print("Vulkan device: " << vulkan.gpuProperties.deviceName << "\n");
     }
     
     // NOTE: Create a device
@@ -355,8 +416,22 @@ Initialize()
             return false;
         }
         vkGetDeviceQueue(vulkan.device, vulkan.computeQueueFamilyIndex, 0, &vulkan.computeQueue);
+        
+        LoadPipelineCache();
     }
     
+#if GPU_PROFILING
+    // NOTE(heyyod): Without timestamps we still get the host side timers
+    if (vulkan.timestampValidBits)
+    {
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = QUERY_COUNT;
+        AssertSuccess(vkCreateQueryPool(vulkan.device, &queryPoolInfo, 0, &vulkan.queryPool));
+    }
+#endif
+    
     // NOTE(heyyod): Create Command Buffer
     {
         VkCommandPoolCreateInfo cmdPoolInfo = {};
@@ -376,45 +451,33 @@ Initialize()
     return true;
 }
 
+// NOTE(heyyod): Copies between two buffers and waits for it. The barriers make the copy
+// wait for any shader writes to src and make dst visible to the shaders and the host.
 func bool Vulkan::
-UploadInputData(void *testData, void *trainData)
+CopyBuffer(vulkan_buffer &src, u64 srcOffset, vulkan_buffer &dst, u64 dstOffset, u64 size)
 {
-    u64 trainDataSize = NUM_TRAIN_IMAGES * PIXELS_PER_IMAGE;
-    u64 testDataSize = NUM_TEST_IMAGES * PIXELS_PER_IMAGE;
-    
-    vulkan_buffer inputStagingBuffer = {};
-    
-    if (!CreateBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, trainDataSize + testDataSize,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, inputStagingBuffer, true))
-    {
-        return false;
-    }
-    
-    memcpy (inputStagingBuffer.data, trainData, trainDataSize);
-    memcpy ((u8 *)inputStagingBuffer.data + trainDataSize, testData, testDataSize);
-    
     VkCommandBufferBeginInfo cmdBufferBeginInfo= {};
     cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     AssertSuccess(vkBeginCommandBuffer(vulkan.cmdBuffer, &cmdBufferBeginInfo));
     
+    VkMemoryBarrier beforeCopy = {};
+    beforeCopy.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    beforeCopy.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    beforeCopy.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(vulkan.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &beforeCopy, 0, 0, 0, 0);
+    
     VkBufferCopy bufferCopyInfo = {};
-    bufferCopyInfo.srcOffset = 0;
-    bufferCopyInfo.dstOffset = 0;
-    bufferCopyInfo.size = trainDataSize + testDataSize;
-    vkCmdCopyBuffer(vulkan.cmdBuffer, inputStagingBuffer.handle, vulkan.valuesBuffer.handle, 1, &bufferCopyInfo);
-    
-    VkBufferMemoryBarrier bufferBarriers[1] = {};
-    bufferBarriers[0].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-    bufferBarriers[0].srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-    bufferBarriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    bufferBarriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    bufferBarriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    bufferBarriers[0].buffer = vulkan.valuesBuffer.handle;
-    bufferBarriers[0].offset = 0;
-    bufferBarriers[0].size = VK_WHOLE_SIZE ;
-    
-    vkCmdPipelineBarrier(vulkan.cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, ArrayCount(bufferBarriers), bufferBarriers, 0, 0);
+    bufferCopyInfo.srcOffset = srcOffset;
+    bufferCopyInfo.dstOffset = dstOffset;
+    bufferCopyInfo.size = size;
+    vkCmdCopyBuffer(vulkan.cmdBuffer, src.handle, dst.handle, 1, &bufferCopyInfo);
+    
+    VkMemoryBarrier afterCopy = {};
+    afterCopy.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    afterCopy.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    afterCopy.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(vulkan.cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &afterCopy, 0, 0, 0, 0);
     
     AssertSuccess(vkEndCommandBuffer(vulkan.cmdBuffer));
     VkSubmitInfo submitInfo = {};
@@ -422,83 +485,229 @@ UploadInputData(void *testData, void *trainData)
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &vulkan.cmdBuffer;
     AssertSuccess(vkQueueSubmit(vulkan.computeQueue, 1, &submitInfo, 0));
+    AssertSuccess(vkQueueWaitIdle(vulkan.computeQueue));
+    return true;
+}
+
+func bool Vulkan::
+CreateStagingBuffer(u64 size, vulkan_buffer &stagingOut)
+{
+    stagingOut = {};
+    return CreateBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size,
+                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingOut, MAP_BUFFER_TRUE);
+}
+
+// NOTE(heyyod): Device local buffers are only reachable through a staging buffer
+func bool Vulkan::
+UploadBuffer(vulkan_buffer &dst, u64 dstOffset, void *data, u64 size)
+{
+    vulkan_buffer staging;
+    bool success = CreateStagingBuffer(size, staging);
+    if (success)
+    {
+        memcpy(staging.data, data, size);
+        success = CopyBuffer(staging, 0, dst, dstOffset, size);
+    }
+    ClearBuffer(staging);
+    return success;
+}
+
+func bool Vulkan::
+DownloadBuffer(vulkan_buffer &src, u64 srcOffset, void *dataOut, u64 size)
+{
+    vulkan_buffer staging;
+    bool success = CreateStagingBuffer(size, staging) && CopyBuffer(src, srcOffset, staging, 0, size);
+    if (success)
+        memcpy(dataOut, staging.data, size);
+    ClearBuffer(staging);
+    return success;
+}
+
+// NOTE(heyyod): The knn shader reads the pixels as uints, 4 at a time. Every image is padded
+// with zeros to a whole number of uints, which adds nothing to the distances.
+func bool Vulkan::
+UploadKnnPixels(u8 *trainPixels, u32 nTrainImages, u8 *testPixels, u32 nTestImages, u32 pixelsPerImg)
+{
+    u32 wordsPerImage = KnnWordsPerImage(pixelsPerImg);
+    u64 imageStride = wordsPerImage * sizeof(u32);
+    u64 size = (u64)(nTrainImages + nTestImages) * imageStride;
     
-    vkQueueWaitIdle(vulkan.computeQueue);
+    vulkan_buffer inputStagingBuffer;
+    if (!CreateStagingBuffer(size, inputStagingBuffer) ||
+        !CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vulkan.knnPixelsBuffer, false))
+    {
+        ClearBuffer(inputStagingBuffer);
+        return false;
+    }
     
-    ClearBuffer(inputStagingBuffer);
+    u8 *dst = (u8 *)inputStagingBuffer.data;
+    if (imageStride == pixelsPerImg)
+    {
+        memcpy(dst, trainPixels, (u64)nTrainImages * pixelsPerImg);
+        memcpy(dst + (u64)nTrainImages * pixelsPerImg, testPixels, (u64)nTestImages * pixelsPerImg);
+    }
+    else
+    {
+        memset(dst, 0, size);
+        for (u32 i = 0; i < nTrainImages; i++)
+            memcpy(dst + i * imageStride, trainPixels + (u64)i * pixelsPerImg, pixelsPerImg);
+        dst += nTrainImages * imageStride;
+        for (u32 i = 0; i < nTestImages; i++)
+            memcpy(dst + i * imageStride, testPixels + (u64)i * pixelsPerImg, pixelsPerImg);
+    }
     
-    return true;
+    bool success = CopyBuffer(inputStagingBuffer, 0, vulkan.knnPixelsBuffer, 0, size);
+    ClearBuffer(inputStagingBuffer);
+    return success;
 }
 
 func bool Vulkan::
-AllocateNeuralNetMemory(u32* layersDims, u32 nLayers, f32 **outWeights, f32 **outBiases, f32 **outValues, f32 **outErrors, f32 **outProducts)
+AllocateNeuralNetMemory(u32* layersDims, u32 nLayers, u32 nInputImages, u32 batchSize, f32 **outOutputValues)
 {
     Assert(nLayers >= 3);
     
-    u64 valuesSize = (NUM_TRAIN_IMAGES + NUM_TEST_IMAGES) * PIXELS_PER_IMAGE;
+    // NOTE(heyyod): The input layer holds every train and test image, the other layers the
+    // values of every image of a batch
+    u64 valuesSize = 0;
     u64 biasesSize = 0;
     u64 weightsSize = 0;
-    u64 productsSize = 0;
     
     for (u32 i = 1; i < nLayers; i++)
     {
         valuesSize += layersDims[i];
         biasesSize += layersDims[i];
         weightsSize += layersDims[i] * layersDims[i-1];
-        u64 count = layersDims[i] * layersDims[i-1] * layersDims[i-1];
-        if (count > productsSize)
-            productsSize = count;
     }
-    valuesSize *= sizeof(f32);
-    productsSize *= sizeof(f32);
+    valuesSize = ((u64)nInputImages * layersDims[0] + batchSize * valuesSize) * sizeof(f32);
     biasesSize *= sizeof(f32);
     weightsSize *= sizeof(f32);
-    u64 errorsSize = biasesSize;
-    
-    // NOTE(heyyod): The weighted vals buffer is recyclable, meaning we constatly save the product
-    // values of a layer given the weights of the next layer. After that we sum them in the weightsBuffer
-    
-    if (CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, valuesSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.valuesBuffer, true) &&
-        CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, biasesSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.biasesBuffer, true) &&
-        CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, weightsSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.weightsBuffer, true) &&
-        CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, productsSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.productsBuffer, true) &&
-        CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, errorsSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.errorsBuffer, true))
-    {
-        *outWeights = (f32 *)vulkan.weightsBuffer.data;
-        *outBiases = (f32 *)vulkan.biasesBuffer.data;
-        *outValues = (f32 *)vulkan.valuesBuffer.data;
-        *outErrors = (f32 *)vulkan.errorsBuffer.data;
-        *outProducts = (f32 *)vulkan.productsBuffer.data;
+    u64 errorsSize = batchSize * biasesSize;
+    u64 outputSize = (u64)batchSize * layersDims[nLayers - 1] * sizeof(f32);
+    u64 batchBufferSize = 2 * batchSize * sizeof(u32);
+    
+    // NOTE(heyyod): Values, weights, biases and errors only move through UploadBuffer/DownloadBuffer
+    // or stay on the gpu. The host writes the images and labels of a batch and reads the output
+    // values back, those are tiny so they stay host visible.
+    VkBufferUsageFlags deviceUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (CreateBuffer(deviceUsage, valuesSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vulkan.valuesBuffer, false) &&
+        CreateBuffer(deviceUsage, biasesSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vulkan.biasesBuffer, false) &&
+        CreateBuffer(deviceUsage, weightsSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vulkan.weightsBuffer, false) &&
+        CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, errorsSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vulkan.errorsBuffer, false) &&
+        CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, batchBufferSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.nnBatchBuffer, true) &&
+        CreateBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT, outputSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.outputReadbackBuffer, true))
+    {
+        vulkan.nnCommands.batchSize = batchSize;
+        *outOutputValues = (f32 *)vulkan.outputReadbackBuffer.data;
         
         return true;
     }
     return false;
 }
 
+// NOTE(heyyod): Only the k nearest of every row come back to the host, unless the top-k
+// runs on the cpu. Then the rows get copied to a host visible buffer too.
 func bool Vulkan::
-AllocateKnnMemory(u32 **distPerImgData, u64 &distPerImgDataSize)
+AllocateKnnMemory(u32 nTrainImages, bool readBackDistances)
 {
-    u64 distPerPixelDataSize = NUM_TRAIN_IMAGES * PIXELS_PER_IMAGE * sizeof(u32);
-    distPerImgDataSize = NUM_TRAIN_IMAGES * sizeof(u32);
+    // NOTE(heyyod): One row of distances per test image of a batch, one batch per slot
+    u64 distPerImgDataSize = (u64)KNN_GPU_SLOTS * KNN_GPU_BATCH_SIZE * nTrainImages * sizeof(u32);
+    u32 nChunks = (nTrainImages + KNN_TOP_K_CHUNK_SIZE - 1) / KNN_TOP_K_CHUNK_SIZE;
+    u64 partialsSize = (u64)KNN_GPU_SLOTS * KNN_GPU_BATCH_SIZE * nChunks * KNN_GPU_MAX_K * sizeof(gpu_neighbour);
+    u64 resultsSize = (u64)KNN_GPU_SLOTS * KNN_GPU_BATCH_SIZE * KNN_GPU_MAX_K * sizeof(gpu_neighbour);
     
-    // NOTE(heyyod): Create buffer for the input and output data
-    if (CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, distPerPixelDataSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.distPerPixelBuffer, true) &&
-        CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, distPerImgDataSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.distPerImgBuffer, true))
+    if (!CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, distPerImgDataSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vulkan.distPerImgBuffer, false) ||
+        !CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, KNN_GPU_SLOTS * sizeof(u32), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.knnBatchBuffer, true) ||
+        !CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, partialsSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vulkan.knnPartialsBuffer, false) ||
+        !CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, resultsSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.knnResultsBuffer, true))
     {
-        *distPerImgData = (u32 *)vulkan.distPerImgBuffer.data;
-        return true;
+        return false;
     }
-    return false;
+    
+    if (readBackDistances)
+        return CreateBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT, distPerImgDataSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vulkan.distReadbackBuffer, true);
+    return true;
+}
+
+// NOTE(heyyod): Every binding of our shaders is a storage buffer
+func bool Vulkan::
+CreateStorageBufferSet(u32 nBuffers, VkDescriptorSetLayout &layoutOut, VkDescriptorSet &setOut)
+{
+    VkDescriptorSetLayoutBinding bindings[MAX_PIPELINE_BINDINGS] = {};
+    Assert(nBuffers <= MAX_PIPELINE_BINDINGS);
+    
+    for (u32 i = 0; i < nBuffers; i++)
+    {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = nBuffers;
+    layoutInfo.pBindings = bindings;
+    AssertSuccess(vkCreateDescriptorSetLayout(vulkan.device, &layoutInfo, 0, &layoutOut));
+    
+    // NOTE(heyyod): One pool for the sets of every pipeline
+    if (!VulkanIsValidHandle(vulkan.descPool))
+    {
+        VkDescriptorPoolSize poolSizes[] = {
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, PIPEPLINE_TYPE_COUNT * MAX_PIPELINE_BINDINGS},
+        };
+        
+        VkDescriptorPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = ArrayCount(poolSizes);
+        poolInfo.pPoolSizes = poolSizes;
+        poolInfo.maxSets = PIPEPLINE_TYPE_COUNT;
+        AssertSuccess(vkCreateDescriptorPool(vulkan.device, &poolInfo, 0, &vulkan.descPool));
+    }
+    
+    VkDescriptorSetAllocateInfo descAlloc = {};
+    descAlloc.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descAlloc.descriptorPool = vulkan.descPool;
+    descAlloc.descriptorSetCount = 1;
+    descAlloc.pSetLayouts = &layoutOut;
+    AssertSuccess(vkAllocateDescriptorSets(vulkan.device, &descAlloc, &setOut));
+    return true;
+}
+
+// NOTE(heyyod): Binds the buffers to the pipeline's set in the order of the array. The set
+// must not be in use by the gpu.
+func void Vulkan::
+WriteStorageBufferSet(vulkan_buffer **buffers, u32 nBuffers, vulkan_pipeline &pipeline)
+{
+    VkDescriptorBufferInfo bufferInfos[MAX_PIPELINE_BINDINGS] = {};
+    VkWriteDescriptorSet writeSets[MAX_PIPELINE_BINDINGS] = {};
+    for (u32 i = 0; i < nBuffers; i++)
+    {
+        Assert(VulkanIsValidHandle(buffers[i]->handle));
+        pipeline.boundBuffers[i] = buffers[i]->handle;
+        bufferInfos[i].buffer = buffers[i]->handle;
+        bufferInfos[i].range = VK_WHOLE_SIZE;
+        
+        writeSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeSets[i].dstSet = pipeline.descSet;
+        writeSets[i].dstBinding = i;
+        writeSets[i].dstArrayElement = 0;
+        writeSets[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeSets[i].descriptorCount = 1;
+        writeSets[i].pBufferInfo = &bufferInfos[i];
+    }
+    vkUpdateDescriptorSets(vulkan.device, nBuffers, writeSets, 0, 0);
 }
 
 func bool Vulkan::
 CreatePipeline(pipeline_type pipelineType)
 {
-    if (VulkanIsValidHandle(vulkan.pipelines[pipelineType].handle))
-        return true;
+    vulkan_pipeline &pipeline = vulkan.pipelines[pipelineType];
     
-    VkShaderModule compShader = {};
-    bool loadedShader = false;
+    // NOTE(heyyod): The buffers have to exist already, they get written to the descriptor set
+    vulkan_buffer *buffers[MAX_PIPELINE_BINDINGS] = {};
+    u32 nBuffers = 0;
+    char *shaderPath = 0;
     
     VkPushConstantRange pushConstant;
     pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
@@ -508,291 +717,450 @@ CreatePipeline(pipeline_type pipelineType)
     {
         case PIPELINE_TYPE_NEAREST_NEIGHBOUR:
         {
-            // TODO(heyyod): I MADE THE INPUT A SINGLE BUFFER FOR TRAIN AND TEST DATA
-            // HAVE NOT TESTED IF K-NN STILL WORKS
-            // NOTE(heyyod): Create shader bindings
-            VkDescriptorSetLayoutBinding bindings[] = {
-                {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-                {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-                {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-            };
-            
-            VkDescriptorSetLayoutCreateInfo layoutInfo = {};
-            layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-            layoutInfo.bindingCount = ArrayCount(bindings);
-            layoutInfo.pBindings = bindings;
-            AssertSuccess(vkCreateDescriptorSetLayout(vulkan.device, &layoutInfo, 0, &vulkan.globalDescSetLayout));
-            
-            VkDescriptorPoolSize poolSizes[] = {
-                {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, ArrayCount(bindings)},
-            };
-            
-            VkDescriptorPoolCreateInfo poolInfo = {};
-            poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-            poolInfo.poolSizeCount = ArrayCount(poolSizes);
-            poolInfo.pPoolSizes = poolSizes;
-            poolInfo.maxSets = 1;
-            AssertSuccess(vkCreateDescriptorPool(vulkan.device, &poolInfo, 0, &vulkan.globalDescPool));
-            
-            VkDescriptorSetAllocateInfo globalDescAlloc = {};
-            globalDescAlloc.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-            globalDescAlloc.descriptorPool = vulkan.globalDescPool;
-            globalDescAlloc.descriptorSetCount = 1;
-            globalDescAlloc.pSetLayouts = &vulkan.globalDescSetLayout;
-            AssertSuccess(vkAllocateDescriptorSets(vulkan.device, &globalDescAlloc, &vulkan.globalDescSet));
-            
-            VkDescriptorBufferInfo inputBufferInfo = {};
-            inputBufferInfo.buffer = vulkan.valuesBuffer.handle;
-            inputBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet writeInputBuffer = {};
-            writeInputBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            writeInputBuffer.dstSet = vulkan.globalDescSet;
-            writeInputBuffer.dstArrayElement = 0;
-            writeInputBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            writeInputBuffer.descriptorCount = 1;
-            writeInputBuffer.dstBinding = 0;
-            writeInputBuffer.pBufferInfo = &inputBufferInfo;
-            
-            VkDescriptorBufferInfo diffPerPixelBufferInfo = {};
-            diffPerPixelBufferInfo.buffer = vulkan.distPerPixelBuffer.handle;
-            diffPerPixelBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet writeDiffPerPixelBuffer = {};
-            writeDiffPerPixelBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            writeDiffPerPixelBuffer.dstSet = vulkan.globalDescSet;
-            writeDiffPerPixelBuffer.dstArrayElement = 0;
-            writeDiffPerPixelBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            writeDiffPerPixelBuffer.descriptorCount = 1;
-            writeDiffPerPixelBuffer.dstBinding = 1;
-            writeDiffPerPixelBuffer.pBufferInfo = &diffPerPixelBufferInfo;
-            
-            VkDescriptorBufferInfo distPerImgBufferInfo = {};
-            distPerImgBufferInfo.buffer = vulkan.distPerImgBuffer.handle;
-            distPerImgBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet writeDistPerImgBuffer = {};
-            writeDistPerImgBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            writeDistPerImgBuffer.dstSet = vulkan.globalDescSet;
-            writeDistPerImgBuffer.dstArrayElement = 0;
-            writeDistPerImgBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            writeDistPerImgBuffer.descriptorCount = 1;
-            writeDistPerImgBuffer.dstBinding = 2;
-            writeDistPerImgBuffer.pBufferInfo = &distPerImgBufferInfo;
-            
-            VkWriteDescriptorSet writeSets[] = {
-                writeInputBuffer,
-                writeDiffPerPixelBuffer,
-                writeDistPerImgBuffer
-            };
-            
-            vkUpdateDescriptorSets(vulkan.device, ArrayCount(writeSets), writeSets, 0, 0);
+            buffers[nBuffers++] = &vulkan.knnPixelsBuffer;
+            buffers[nBuffers++] = &vulkan.distPerImgBuffer;
+            buffers[nBuffers++] = &vulkan.knnBatchBuffer;
             pushConstant.size = sizeof(push_constants_knn);
-            loadedShader = LoadShader("..\\build\\shaders\\NearestNeighbour.comp.spv", &compShader);
+            shaderPath = "../build/shaders/NearestNeighbour.comp.spv";
         }break;
         
-        case PIPELINE_TYPE_FEED_FORWARD:
+        case PIPELINE_TYPE_KNN_TOP_K:
         {
-            // NOTE(heyyod): Create shader bindings
-            VkDescriptorSetLayoutBinding bindings[] = {
-                {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-                {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-                {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-                {3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-                {4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0},
-            };
-            
-            VkDescriptorSetLayoutCreateInfo layoutInfo = {};
-            layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-            layoutInfo.bindingCount = ArrayCount(bindings);
-            layoutInfo.pBindings = bindings;
-            AssertSuccess(vkCreateDescriptorSetLayout(vulkan.device, &layoutInfo, 0, &vulkan.globalDescSetLayout));
-            
-            VkDescriptorPoolSize poolSizes[] = {
-                {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, ArrayCount(bindings)},
-            };
-            
-            VkDescriptorPoolCreateInfo poolInfo = {};
-            poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-            poolInfo.poolSizeCount = ArrayCount(poolSizes);
-            poolInfo.pPoolSizes = poolSizes;
-            poolInfo.maxSets = 1;
-            AssertSuccess(vkCreateDescriptorPool(vulkan.device, &poolInfo, 0, &vulkan.globalDescPool));
-            
-            VkDescriptorSetAllocateInfo globalDescAlloc = {};
-            globalDescAlloc.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-            globalDescAlloc.descriptorPool = vulkan.globalDescPool;
-            globalDescAlloc.descriptorSetCount = 1;
-            globalDescAlloc.pSetLayouts = &vulkan.globalDescSetLayout;
-            AssertSuccess(vkAllocateDescriptorSets(vulkan.device, &globalDescAlloc, &vulkan.globalDescSet));
-            
-            VkDescriptorBufferInfo inputBufferInfo = {};
-            inputBufferInfo.buffer = vulkan.valuesBuffer.handle;
-            inputBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet inputBuffer = {};
-            inputBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            inputBuffer.dstSet = vulkan.globalDescSet;
-            inputBuffer.dstArrayElement = 0;
-            inputBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            inputBuffer.descriptorCount = 1;
-            inputBuffer.dstBinding = 0;
-            inputBuffer.pBufferInfo = &inputBufferInfo;
-            
-            VkDescriptorBufferInfo weightsBufferInfo = {};
-            weightsBufferInfo.buffer = vulkan.weightsBuffer.handle;
-            weightsBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet weightsBuffer = {};
-            weightsBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            weightsBuffer.dstSet = vulkan.globalDescSet;
-            weightsBuffer.dstArrayElement = 0;
-            weightsBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            weightsBuffer.descriptorCount = 1;
-            weightsBuffer.dstBinding = 1;
-            weightsBuffer.pBufferInfo = &weightsBufferInfo;
-            
-            VkDescriptorBufferInfo biasesBufferInfo = {};
-            biasesBufferInfo.buffer = vulkan.biasesBuffer.handle;
-            biasesBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet biasesBuffer = {};
-            biasesBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            biasesBuffer.dstSet = vulkan.globalDescSet;
-            biasesBuffer.dstArrayElement = 0;
-            biasesBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            biasesBuffer.descriptorCount = 1;
-            biasesBuffer.dstBinding = 2;
-            biasesBuffer.pBufferInfo = &biasesBufferInfo;
-            
-            VkDescriptorBufferInfo productsBufferInfo = {};
-            productsBufferInfo.buffer = vulkan.productsBuffer.handle;
-            productsBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet productsBuffer = {};
-            productsBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            productsBuffer.dstSet = vulkan.globalDescSet;
-            productsBuffer.dstArrayElement = 0;
-            productsBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            productsBuffer.descriptorCount = 1;
-            productsBuffer.dstBinding = 3;
-            productsBuffer.pBufferInfo = &productsBufferInfo;
-            
-            VkDescriptorBufferInfo errorsBufferInfo = {};
-            errorsBufferInfo.buffer = vulkan.errorsBuffer.handle;
-            errorsBufferInfo.range = VK_WHOLE_SIZE;
-            VkWriteDescriptorSet errorsBuffer = {};
-            errorsBuffer.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            errorsBuffer.dstSet = vulkan.globalDescSet;
-            errorsBuffer.dstArrayElement = 0;
-            errorsBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            errorsBuffer.descriptorCount = 1;
-            errorsBuffer.dstBinding = 4;
-            errorsBuffer.pBufferInfo = &errorsBufferInfo;
-            
-            VkWriteDescriptorSet writeSets[] = {
-                inputBuffer,
-                weightsBuffer,
-                biasesBuffer,
-                productsBuffer,
-                errorsBuffer
-            };
-            
-            vkUpdateDescriptorSets(vulkan.device, ArrayCount(writeSets), writeSets, 0, 0);
-            pushConstant.size = sizeof(push_constants_feed_forward);
-            loadedShader = LoadShader("..\\build\\shaders\\FeedForward.comp.spv", &compShader);
+            buffers[nBuffers++] = &vulkan.distPerImgBuffer;
+            buffers[nBuffers++] = &vulkan.knnPartialsBuffer;
+            buffers[nBuffers++] = &vulkan.knnResultsBuffer;
+            pushConstant.size = sizeof(push_constants_knn_top_k);
+            shaderPath = "../build/shaders/KnnTopK.comp.spv";
         }break;
         
+        case PIPELINE_TYPE_FEED_FORWARD:
         case PIPELINE_TYPE_BACK_PROPAGATE:
         {
-            Assert(VulkanIsValidHandle(vulkan.pipelines[PIPELINE_TYPE_FEED_FORWARD].handle));
-            pushConstant.size = sizeof(push_constants_back_propagate);
-            loadedShader = LoadShader("..\\build\\shaders\\BackPropagate.comp.spv", &compShader);
+            // NOTE(heyyod): Both neural net shaders see the same buffers. Feed forward
+            // doesn't use the errors but it is simpler to keep the bindings the same.
+            buffers[nBuffers++] = &vulkan.valuesBuffer;
+            buffers[nBuffers++] = &vulkan.weightsBuffer;
+            buffers[nBuffers++] = &vulkan.biasesBuffer;
+            buffers[nBuffers++] = &vulkan.errorsBuffer;
+            buffers[nBuffers++] = &vulkan.nnBatchBuffer;
+            if (pipelineType == PIPELINE_TYPE_FEED_FORWARD)
+            {
+                pushConstant.size = sizeof(push_constants_feed_forward);
+                shaderPath = "../build/shaders/FeedForward.comp.spv";
+            }
+            else
+            {
+                pushConstant.size = sizeof(push_constants_back_propagate);
+                shaderPath = "../build/shaders/BackPropagate.comp.spv";
+            }
         }break;
+        
+        default:
+        {
+            return false;
+        }
     }
     
-    if(!loadedShader)
+    // NOTE(heyyod): CreateBuffer recreates buffers that are too small for a new data set, then
+    // the set has to point to the new ones. Updating a set invalidates the command buffers
+    // that bound it, so the recorded knn commands go too.
+    if (VulkanIsValidHandle(pipeline.handle))
     {
-        Assert("Couldn't load shaders");
+        bool rebind = false;
+        for (u32 i = 0; i < nBuffers; i++)
+            rebind = rebind || (buffers[i]->handle != pipeline.boundBuffers[i]);
+        if (rebind)
+        {
+            vkDeviceWaitIdle(vulkan.device);
+            FreeKnnCommands();
+            WriteStorageBufferSet(buffers, nBuffers, pipeline);
+        }
+        return true;
+    }
+    
+    VkShaderModule compShader = {};
+    if (!LoadShader(shaderPath, &compShader))
+    {
+        Print("Couldn't load shader " << shaderPath << "\n");
         return false;
     }
     
-    VkPipelineShaderStageCreateInfo shaderStageCreateInfo = {};
-    shaderStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    shaderStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    shaderStageCreateInfo.module = compShader;
-    shaderStageCreateInfo.pName = "main";
-    
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &vulkan.globalDescSetLayout ;
-    pipelineLayoutInfo.pushConstantRangeCount = 1;
-    pipelineLayoutInfo.pPushConstantRanges = &pushConstant;
-    AssertSuccess(vkCreatePipelineLayout(vulkan.device, &pipelineLayoutInfo, 0, &vulkan.pipelines[pipelineType].layout));
-    
-    VkComputePipelineCreateInfo pipelineCreateInfo = {};
-    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-    pipelineCreateInfo.stage = shaderStageCreateInfo;
-    pipelineCreateInfo.layout = vulkan.pipelines[pipelineType].layout;
-    AssertSuccess(vkCreateComputePipelines(vulkan.device, 0, 1, &pipelineCreateInfo, 0, &vulkan.pipelines[pipelineType].handle));
+    bool success = CreateStorageBufferSet(nBuffers, pipeline.descSetLayout, pipeline.descSet);
+    if (success)
+    {
+        WriteStorageBufferSet(buffers, nBuffers, pipeline);
+        
+        VkPipelineShaderStageCreateInfo shaderStageCreateInfo = {};
+        shaderStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shaderStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        shaderStageCreateInfo.module = compShader;
+        shaderStageCreateInfo.pName = "main";
+        
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &pipeline.descSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstant;
+        success = vkCreatePipelineLayout(vulkan.device, &pipelineLayoutInfo, 0, &pipeline.layout) == VK_SUCCESS;
+        
+        if (success)
+        {
+            VkComputePipelineCreateInfo pipelineCreateInfo = {};
+            pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+            pipelineCreateInfo.stage = shaderStageCreateInfo;
+            pipelineCreateInfo.layout = pipeline.layout;
+            success = vkCreateComputePipelines(vulkan.device, vulkan.pipelineCache, 1, &pipelineCreateInfo, 0, &pipeline.handle) == VK_SUCCESS;
+        }
+    }
+    vkDestroyShaderModule(vulkan.device, compShader, 0);
+    
+    if (!success)
+    {
+        Print("Couldn't create pipeline for " << shaderPath << "\n");
+        return false;
+    }
     DebugPrint("Created Pipeline\n");
+    return true;
+}
+
+func bool Vulkan::
+RecordKnnCommands(VkCommandBuffer cmdBuffer, u32 slot, u32 nTests)
+{
+    // NOTE(heyyod): The shader computes tiles of KNN_TILE_TESTS test images by KNN_TILE_TRAIN
+    // train images, so the whole batch is a single dispatch
+    u32 nTrainImages = vulkan.knnCommands.nTrainImages;
+    vulkan_pipeline &pipeline = vulkan.pipelines[PIPELINE_TYPE_NEAREST_NEIGHBOUR];
     
-    vkDestroyShaderModule(vulkan.device, compShader, 0);
+    push_constants_knn pc  = {};
+    pc.slot = slot;
+    pc.nTests = nTests;
+    pc.nTrainImages = nTrainImages;
+    pc.wordsPerImage = vulkan.knnCommands.wordsPerImage;
+    pc.distOffset = slot * KNN_GPU_BATCH_SIZE * nTrainImages;
+    pc.distP = vulkan.knnCommands.distP;
+    
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    u32 firstQuery = slot * QUERIES_PER_KNN_SLOT;
+    
+    AssertSuccess(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
+    if (VulkanIsValidHandle(vulkan.queryPool))
+        vkCmdResetQueryPool(cmdBuffer, vulkan.queryPool, firstQuery, QUERIES_PER_KNN_SLOT);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.handle);
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.layout, 0, 1, &pipeline.descSet, 0, 0);
+    vkCmdPushConstants(cmdBuffer, pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    CmdTimestamp(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, firstQuery);
+    vkCmdDispatch(cmdBuffer, (nTrainImages + KNN_TILE_TRAIN - 1) / KNN_TILE_TRAIN, (nTests + KNN_TILE_TESTS - 1) / KNN_TILE_TESTS, 1);
+    CmdTimestamp(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, firstQuery + 1);
+    
+    if (vulkan.knnCommands.k)
+    {
+        vulkan_pipeline &topKPipeline = vulkan.pipelines[PIPELINE_TYPE_KNN_TOP_K];
+        
+        VkMemoryBarrier computeBarrier = {};
+        computeBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        computeBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        computeBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        
+        push_constants_knn_top_k topKPc = {};
+        topKPc.k = vulkan.knnCommands.k;
+        topKPc.nDists = nTrainImages;
+        topKPc.chunkSize = KNN_TOP_K_CHUNK_SIZE;
+        topKPc.nChunks = (nTrainImages + KNN_TOP_K_CHUNK_SIZE - 1) / KNN_TOP_K_CHUNK_SIZE;
+        topKPc.distOffset = slot * KNN_GPU_BATCH_SIZE * nTrainImages;
+        topKPc.partialsOffset = slot * KNN_GPU_BATCH_SIZE * topKPc.nChunks * KNN_GPU_MAX_K;
+        topKPc.resultsOffset = slot * KNN_GPU_BATCH_SIZE * KNN_GPU_MAX_K;
+        
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, topKPipeline.handle);
+        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, topKPipeline.layout, 0, 1, &topKPipeline.descSet, 0, 0);
+        
+        // NOTE(heyyod): A workgroup per chunk of every row, then one per row to merge the chunks
+        vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &computeBarrier, 0, 0, 0, 0);
+        CmdTimestamp(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, firstQuery + 2);
+        topKPc.stage = 0;
+        vkCmdPushConstants(cmdBuffer, topKPipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(topKPc), &topKPc);
+        vkCmdDispatch(cmdBuffer, topKPc.nChunks, nTests, 1);
+        
+        vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &computeBarrier, 0, 0, 0, 0);
+        topKPc.stage = 1;
+        vkCmdPushConstants(cmdBuffer, topKPipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(topKPc), &topKPc);
+        vkCmdDispatch(cmdBuffer, 1, nTests, 1);
+        CmdTimestamp(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, firstQuery + 3);
+    }
+    
+    else
+    {
+        // NOTE(heyyod): The cpu does the top-k, so it needs the whole rows
+        VkMemoryBarrier copyBarrier = {};
+        copyBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        copyBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        copyBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &copyBarrier, 0, 0, 0, 0);
+        
+        VkBufferCopy rowsCopy = {};
+        rowsCopy.srcOffset = (u64)pc.distOffset * sizeof(u32);
+        rowsCopy.dstOffset = rowsCopy.srcOffset;
+        rowsCopy.size = (u64)nTests * nTrainImages * sizeof(u32);
+        vkCmdCopyBuffer(cmdBuffer, vulkan.distPerImgBuffer.handle, vulkan.distReadbackBuffer.handle, 1, &rowsCopy);
+    }
+    
+    // NOTE(heyyod): Make the results visible to the host
+    VkMemoryBarrier hostBarrier = {};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, 0, 0, 0);
+    AssertSuccess(vkEndCommandBuffer(cmdBuffer));
     return true;
 }
 
 func void Vulkan::
-GetGroupCountAndBatches(u32 totalInvocations, u32 groupSize, u32 &groupCount, u32 &batches)
+FreeKnnCommands()
 {
-    u32 totalGroupCount = totalInvocations / groupSize;
-    if (totalGroupCount == 0)
-        totalGroupCount = totalInvocations;
-    else
+    knn_commands &commands = vulkan.knnCommands;
+    for (u32 i = 0; i < KNN_GPU_SLOTS; i++)
     {
-        while (totalGroupCount * groupSize < totalInvocations)
+        knn_slot &slot = commands.slots[i];
+        if (VulkanIsValidHandle(vulkan.cmdPool))
         {
-            totalGroupCount++;
+            if (VulkanIsValidHandle(slot.fullBatch))
+                vkFreeCommandBuffers(vulkan.device, vulkan.cmdPool, 1, &slot.fullBatch);
+            if (VulkanIsValidHandle(slot.tailBatch))
+                vkFreeCommandBuffers(vulkan.device, vulkan.cmdPool, 1, &slot.tailBatch);
         }
+        if (VulkanIsValidHandle(slot.fence))
+            vkDestroyFence(vulkan.device, slot.fence, 0);
     }
+    commands = {};
+}
+
+// NOTE(heyyod): Starts computing the distances of test images [firstTestIndex, firstTestIndex + nTests)
+// to every train image and returns without waiting. Row i of KnnSlotDistances(slot) belongs
+// to test image firstTestIndex + i once KnnWait(slot) returns. With k > 0 the gpu also
+// selects the k nearest of every row, row i of KnnSlotNeighbours(slot) holds them sorted.
+// wordsPerImage is the stride UploadKnnPixels used, KnnWordsPerImage of the pixels per image.
+func bool Vulkan::
+KnnSubmit(u32 slot, u32 firstTestIndex, u32 nTests, u32 distP, u32 nTrainImages, u32 wordsPerImage, u32 k)
+{
+    Assert(k <= KNN_GPU_MAX_K);
+    Assert(slot < KNN_GPU_SLOTS);
+    Assert(nTests > 0 && nTests <= KNN_GPU_BATCH_SIZE);
+    knn_commands &commands = vulkan.knnCommands;
     
-    u32 maxGroupCount = vulkan.gpuProperties.limits.maxComputeWorkGroupCount[0];
-    batches = totalGroupCount / maxGroupCount;
+    // NOTE(heyyod): The recorded commands bake in the distance, the train set size, the image
+    // stride and k. FreeKnnCommands resets all of them, so they are set again after it.
+    if (commands.nTrainImages && (commands.distP != distP || commands.nTrainImages != nTrainImages ||
+                                  commands.wordsPerImage != wordsPerImage || commands.k != k))
+    {
+        vkDeviceWaitIdle(vulkan.device);
+        FreeKnnCommands();
+    }
+    commands.distP = distP;
+    commands.nTrainImages = nTrainImages;
+    commands.wordsPerImage = wordsPerImage;
+    commands.k = k;
     
-    if (batches == 0)
+    knn_slot &knnSlot = commands.slots[slot];
+    if (knnSlot.inFlight && !KnnWait(slot))
+        return false;
+    
+    if (!VulkanIsValidHandle(knnSlot.fence))
     {
-        groupCount = totalGroupCount;
-        batches = 1;
+        VkFenceCreateInfo fenceInfo = {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        AssertSuccess(vkCreateFence(vulkan.device, &fenceInfo, 0, &knnSlot.fence));
     }
-    else
+    
+    VkCommandBuffer *cmdBuffer = (nTests == KNN_GPU_BATCH_SIZE) ? &knnSlot.fullBatch : &knnSlot.tailBatch;
+    bool record = !VulkanIsValidHandle(*cmdBuffer) || (nTests != KNN_GPU_BATCH_SIZE && knnSlot.tailBatchSize != nTests);
+    if (!VulkanIsValidHandle(*cmdBuffer))
     {
-        if (totalGroupCount % maxGroupCount > 0)
-            batches++;
-        groupCount = vulkan.gpuProperties.limits.maxComputeWorkGroupCount[0];
-        
-        while (groupCount * batches * groupSize < totalInvocations)
-            batches++;
-        
-        while (groupCount * batches * groupSize > totalInvocations)
-            groupCount--;
-        while (groupCount * batches * groupSize < totalInvocations)
-            groupCount++;
+        VkCommandBufferAllocateInfo cmdBufferAllocInfo = {};
+        cmdBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        cmdBufferAllocInfo.commandPool = vulkan.cmdPool;
+        cmdBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        cmdBufferAllocInfo.commandBufferCount = 1;
+        AssertSuccess(vkAllocateCommandBuffers(vulkan.device, &cmdBufferAllocInfo, cmdBuffer));
+    }
+    if (record)
+    {
+        if (!RecordKnnCommands(*cmdBuffer, slot, nTests))
+            return false;
+        if (nTests != KNN_GPU_BATCH_SIZE)
+            knnSlot.tailBatchSize = nTests;
     }
+    
+    // NOTE(heyyod): Safe to write, the last batch of this slot has finished
+    ((u32 *)vulkan.knnBatchBuffer.data)[slot] = firstTestIndex;
+    
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = cmdBuffer;
+    knnSlot.submitTime = Now();
+    AssertSuccess(vkQueueSubmit(vulkan.computeQueue, 1, &submitInfo, knnSlot.fence));
+    ProfileRecord(PROFILE_SUBMIT, NsSince(knnSlot.submitTime));
+    knnSlot.inFlight = true;
+    return true;
 }
 
 func bool Vulkan::
-KnnCompute(u32 &testImageIndex, u32 distP)
+KnnWait(u32 slot)
 {
-    // NOTE(heyyod): In glsl the u8 array is "casted" to a uint array, so
-    // each element of the array contains 4 pixels. This means that in one invocation
-    // we operate on 4 pixels and so we need 784/4=196 invocations per image.
-    // So the total number of workgroups is the number of images we test against. 
-    u32 groupCount = NUM_TRAIN_IMAGES;
+    knn_slot &knnSlot = vulkan.knnCommands.slots[slot];
+    if (!knnSlot.inFlight)
+        return true;
     
-    push_constants_knn pc  = {};
-    pc.testId = testImageIndex;
+    if (!knnSlot.done)
+    {
+        AssertSuccess(vkWaitForFences(vulkan.device, 1, &knnSlot.fence, VK_TRUE, U64_MAX));
+        ProfileRecord(PROFILE_ROUND_TRIP, NsSince(knnSlot.submitTime));
+    }
+    AssertSuccess(vkResetFences(vulkan.device, 1, &knnSlot.fence));
+    knnSlot.inFlight = false;
+    knnSlot.done = false;
+    RecordGpuTimes(slot * QUERIES_PER_KNN_SLOT, vulkan.knnCommands.k ? 2 : 1, PROFILE_KNN_DISTANCES);
+    return true;
+}
+
+// NOTE(heyyod): Called between the cpu work on another slot. A slot that finished while we
+// were busy would otherwise get that cpu time added to its round trip in KnnWait.
+func void Vulkan::
+KnnPoll()
+{
+#if GPU_PROFILING
+    for (u32 i = 0; i < KNN_GPU_SLOTS; i++)
+    {
+        knn_slot &knnSlot = vulkan.knnCommands.slots[i];
+        if (knnSlot.inFlight && !knnSlot.done && vkGetFenceStatus(vulkan.device, knnSlot.fence) == VK_SUCCESS)
+        {
+            ProfileRecord(PROFILE_ROUND_TRIP, NsSince(knnSlot.submitTime));
+            knnSlot.done = true;
+        }
+    }
+#endif
+}
+
+func u32 *Vulkan::
+KnnSlotDistances(u32 slot)
+{
+    u64 rowOffset = (u64)slot * KNN_GPU_BATCH_SIZE * vulkan.knnCommands.nTrainImages;
+    Assert(vulkan.distReadbackBuffer.data);
+    return (u32 *)vulkan.distReadbackBuffer.data + rowOffset;
+}
+
+func gpu_neighbour *Vulkan::
+KnnSlotNeighbours(u32 slot)
+{
+    return (gpu_neighbour *)vulkan.knnResultsBuffer.data + (u64)slot * KNN_GPU_BATCH_SIZE * KNN_GPU_MAX_K;
+}
+
+// NOTE(heyyod): Starts the command buffer of a batch. labels can be 0 when the batch only
+// gets fed forward.
+func bool Vulkan::
+BeginNeuralNetCommands(u32 *images, u32 *labels, u32 nImages)
+{
+    nn_commands &commands = vulkan.nnCommands;
+    Assert(nImages <= commands.batchSize);
+    u32 *batch = (u32 *)vulkan.nnBatchBuffer.data;
+    for (u32 b = 0; b < nImages; b++)
+    {
+        batch[2 * b] = images[b];
+        batch[2 * b + 1] = labels ? labels[b] : 0;
+    }
+    
+    commands.fedForward = false;
+    commands.backPropagated = false;
+    commands.recordTime = Now();
     
     VkCommandBufferBeginInfo beginInfo = {};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     AssertSuccess(vkBeginCommandBuffer(vulkan.cmdBuffer, &beginInfo));
-    vkCmdBindPipeline(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vulkan.pipelines[PIPELINE_TYPE_NEAREST_NEIGHBOUR].handle);
-    vkCmdBindDescriptorSets(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vulkan.pipelines[PIPELINE_TYPE_NEAREST_NEIGHBOUR].layout, 0, 1, &vulkan.globalDescSet, 0, 0);
-    vkCmdPushConstants(vulkan.cmdBuffer, vulkan.pipelines[PIPELINE_TYPE_NEAREST_NEIGHBOUR].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
-    vkCmdDispatch(vulkan.cmdBuffer, groupCount, 1, 1);
+    if (VulkanIsValidHandle(vulkan.queryPool))
+        vkCmdResetQueryPool(vulkan.cmdBuffer, vulkan.queryPool, QUERY_FEED_FORWARD, 4);
+    return true;
+}
+
+// NOTE(heyyod): Every layer reads the values the previous dispatch wrote
+func void Vulkan::
+CmdComputeBarrier(VkCommandBuffer cmdBuffer)
+{
+    VkMemoryBarrier computeBarrier = {};
+    computeBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    computeBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    computeBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &computeBarrier, 0, 0, 0, 0);
+}
+
+// NOTE(heyyod): One workgroup per output neuron and image for every layer after the input
+// one, see FeedForward.comp
+func void Vulkan::
+FeedForwardCompute(push_constants_feed_forward *layers, u32 nLayers, u32 nImages)
+{
+    vulkan_pipeline &pipeline = vulkan.pipelines[PIPELINE_TYPE_FEED_FORWARD];
+    vkCmdBindPipeline(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.handle);
+    vkCmdBindDescriptorSets(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.layout, 0, 1, &pipeline.descSet, 0, 0);
+    CmdTimestamp(vulkan.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, QUERY_FEED_FORWARD);
+    for (u32 i = 0; i < nLayers; i++)
+    {
+        if (i > 0)
+            CmdComputeBarrier(vulkan.cmdBuffer);
+        vkCmdPushConstants(vulkan.cmdBuffer, pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(layers[i]), &layers[i]);
+        vkCmdDispatch(vulkan.cmdBuffer, layers[i].outValuesDim, nImages, 1);
+    }
+    CmdTimestamp(vulkan.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, QUERY_FEED_FORWARD + 1);
+    vulkan.nnCommands.fedForward = true;
+}
+
+// NOTE(heyyod): One workgroup per neuron of the previous layer, from the output layer back.
+// See BackPropagate.comp.
+func void Vulkan::
+BackPropagateCompute(push_constants_back_propagate *layers, u32 nLayers)
+{
+    vulkan_pipeline &pipeline = vulkan.pipelines[PIPELINE_TYPE_BACK_PROPAGATE];
+    vkCmdBindPipeline(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.handle);
+    vkCmdBindDescriptorSets(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.layout, 0, 1, &pipeline.descSet, 0, 0);
+    CmdTimestamp(vulkan.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, QUERY_BACK_PROPAGATE);
+    for (u32 i = 0; i < nLayers; i++)
+    {
+        CmdComputeBarrier(vulkan.cmdBuffer);
+        vkCmdPushConstants(vulkan.cmdBuffer, pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(layers[i]), &layers[i]);
+        vkCmdDispatch(vulkan.cmdBuffer, layers[i].outErrorsDim, 1, 1);
+    }
+    CmdTimestamp(vulkan.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, QUERY_BACK_PROPAGATE + 1);
+    vulkan.nnCommands.backPropagated = true;
+}
+
+// NOTE(heyyod): The values live in device memory, copy the output layer out for the host
+func void Vulkan::
+CopyOutputCompute(u32 valuesIndex, u32 nValues)
+{
+    VkMemoryBarrier copyBarrier = {};
+    copyBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    copyBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    copyBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(vulkan.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &copyBarrier, 0, 0, 0, 0);
+    
+    VkBufferCopy outputCopy = {};
+    outputCopy.srcOffset = (u64)valuesIndex * sizeof(f32);
+    outputCopy.dstOffset = 0;
+    outputCopy.size = (u64)nValues * sizeof(f32);
+    vkCmdCopyBuffer(vulkan.cmdBuffer, vulkan.valuesBuffer.handle, vulkan.outputReadbackBuffer.handle, 1, &outputCopy);
+    
+    VkMemoryBarrier hostBarrier = {};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(vulkan.cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, 0, 0, 0);
+}
+
+// NOTE(heyyod): One submit and one wait for the whole batch
+func bool Vulkan::
+SubmitNeuralNetCommands()
+{
+    nn_commands &commands = vulkan.nnCommands;
     AssertSuccess(vkEndCommandBuffer(vulkan.cmdBuffer));
     
     VkSubmitInfo submitInfo = {};
@@ -800,149 +1168,153 @@ KnnCompute(u32 &testImageIndex, u32 distP)
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &vulkan.cmdBuffer;
     AssertSuccess(vkQueueSubmit(vulkan.computeQueue, 1, &submitInfo, 0));
+    ProfileRecord(PROFILE_SUBMIT, NsSince(commands.recordTime));
     AssertSuccess(vkQueueWaitIdle(vulkan.computeQueue));
+    ProfileRecord(PROFILE_ROUND_TRIP, NsSince(commands.recordTime));
+    if (commands.fedForward)
+        RecordGpuTimes(QUERY_FEED_FORWARD, 1, PROFILE_FEED_FORWARD);
+    if (commands.backPropagated)
+        RecordGpuTimes(QUERY_BACK_PROPAGATE, 1, PROFILE_BACK_PROPAGATE);
     return true;
 }
 
-func bool Vulkan::
-FeedForwardCompute(u32 inValuesIndex, u32 inValuesDim, u32 weightsIndex, u32 weightsDim,
-                   u32 biasesIndex, u32 outValuesIndex, u32 outValuesDim)
+// NOTE(heyyod): Begin timestamps use the compute stage too. A top of pipe one gets written as
+// soon as the gpu reaches the command, before the work queued ahead of it (the previous
+// dispatch or the other knn slot) is done, and that time would count towards this kernel.
+func void Vulkan::
+CmdTimestamp(VkCommandBuffer cmdBuffer, VkPipelineStageFlagBits stage, u32 query)
 {
-    u32 totalInvocations = inValuesDim * outValuesDim;
-    u32 groupCount;
-    u32 batches;
-    GetGroupCountAndBatches(totalInvocations, 1024, groupCount, batches);
-    
-    push_constants_feed_forward pc = {};
-    pc.inValuesIndex = inValuesIndex;
-    pc.inValuesDim = inValuesDim;
-    pc.weightsIndex = weightsIndex;
-    pc.weightsDim = weightsDim;
-    pc.biasesIndex = biasesIndex;
-    pc.outValuesIndex = outValuesIndex;
-    pc.outValuesDim = outValuesDim;
-    pc.maxBatches = batches;
-    
-    for (u32 batch = 0; batch < batches; batch++)
-    {
-        pc.batch = batch;
-        
-        VkCommandBufferBeginInfo beginInfo = {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        AssertSuccess(vkBeginCommandBuffer(vulkan.cmdBuffer, &beginInfo));
-        vkCmdBindPipeline(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vulkan.pipelines[PIPELINE_TYPE_FEED_FORWARD].handle);
-        vkCmdBindDescriptorSets(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vulkan.pipelines[PIPELINE_TYPE_FEED_FORWARD].layout, 0, 1, &vulkan.globalDescSet, 0, 0);
-        vkCmdPushConstants(vulkan.cmdBuffer, vulkan.pipelines[PIPELINE_TYPE_FEED_FORWARD].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
-        vkCmdDispatch(vulkan.cmdBuffer, groupCount, 1, 1);
-        AssertSuccess(vkEndCommandBuffer(vulkan.cmdBuffer));
-        
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &vulkan.cmdBuffer;
-        AssertSuccess(vkQueueSubmit(vulkan.computeQueue, 1, &submitInfo, 0));
-        AssertSuccess(vkQueueWaitIdle(vulkan.computeQueue));
-    }
-    return true;
+    if (VulkanIsValidHandle(vulkan.queryPool))
+        vkCmdWriteTimestamp(cmdBuffer, stage, vulkan.queryPool, query);
 }
 
-func bool Vulkan::
-BackPropagateCompute(u32 currLayerValuesIndex, u32 prevLayerValuesIndex,
-                     u32 inErrorsIndex, u32 inErrorsDim, u32 weightsIndex, u32 weightsDim, u32 biasesIndex,
-                     u32 outErrorsIndex, u32 outErrorsDim, f32 learningRate, u32 layerIndex)
+// NOTE(heyyod): Reads nPairs begin/end timestamp pairs starting at firstQuery into the
+// histograms firstTimer, firstTimer + 1, ... The work has finished so WAIT never blocks.
+func void Vulkan::
+RecordGpuTimes(u32 firstQuery, u32 nPairs, profile_timer firstTimer)
 {
-    u32 totalInvocations = inErrorsDim * outErrorsDim;
-    u32 groupCount;
-    u32 batches;
-    GetGroupCountAndBatches(totalInvocations, 1024, groupCount, batches);
-    
-    push_constants_back_propagate pc = {};
-    pc.currLayerValuesIndex = currLayerValuesIndex;
-    pc.prevLayerValuesIndex = prevLayerValuesIndex;
-    pc.inErrorsIndex = inErrorsIndex;
-    pc.inErrorsDim = inErrorsDim;
-    pc.weightsIndex = weightsIndex;
-    pc.weightsDim = weightsDim;
-    pc.biasesIndex = biasesIndex;
-    pc.outErrorsIndex = outErrorsIndex;
-    pc.outErrorsDim = outErrorsDim;
-    pc.learningRate = learningRate;
-    pc.layerIndex = layerIndex;
-    pc.maxBatches = batches;
-    
-    for (u32 batch = 0; batch < batches; batch++)
-    {
-        pc.batch = batch;
-        
-        VkCommandBufferBeginInfo beginInfo = {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        AssertSuccess(vkBeginCommandBuffer(vulkan.cmdBuffer, &beginInfo));
-        vkCmdBindPipeline(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vulkan.pipelines[PIPELINE_TYPE_BACK_PROPAGATE].handle);
-        vkCmdBindDescriptorSets(vulkan.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vulkan.pipelines[PIPELINE_TYPE_BACK_PROPAGATE].layout, 0, 1, &vulkan.globalDescSet, 0, 0);
-        vkCmdPushConstants(vulkan.cmdBuffer, vulkan.pipelines[PIPELINE_TYPE_BACK_PROPAGATE].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
-        vkCmdDispatch(vulkan.cmdBuffer, groupCount, 1, 1);
-        AssertSuccess(vkEndCommandBuffer(vulkan.cmdBuffer));
-        
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &vulkan.cmdBuffer;
-        AssertSuccess(vkQueueSubmit(vulkan.computeQueue, 1, &submitInfo, 0));
-        AssertSuccess(vkQueueWaitIdle(vulkan.computeQueue));
+    if (!VulkanIsValidHandle(vulkan.queryPool))
+        return;
+    
+    u64 ticks[QUERIES_PER_KNN_SLOT];
+    Assert(nPairs * 2 <= ArrayCount(ticks));
+    if (vkGetQueryPoolResults(vulkan.device, vulkan.queryPool, firstQuery, nPairs * 2, sizeof(ticks), ticks, sizeof(u64),
+                              VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS)
+        return;
+    
+    u64 mask = (vulkan.timestampValidBits >= 64) ? U64_MAX : ((1ull << vulkan.timestampValidBits) - 1);
+    for (u32 i = 0; i < nPairs; i++)
+    {
+        u64 elapsedTicks = (ticks[2 * i + 1] - ticks[2 * i]) & mask;
+        ProfileRecord((profile_timer)(firstTimer + i), (u64)(elapsedTicks * vulkan.gpuProperties.limits.timestampPeriod));
     }
-    return true;
 }
 
 func bool Vulkan::
 LoadShader(char *filepath, VkShaderModule *shaderOut)
 {
-    
-    // NOTE(heyyod): read file code from:
-    // https://github.com/Erkaman/vulkan_minimal_compute/blob/master/src/main.cpp
-    FILE* fp = fopen(filepath, "rb");
-    if (fp == NULL) 
+    u64 codeSize = 0;
+    u8 *shaderCode = ReadEntireFile(filepath, codeSize);
+    if (!shaderCode)
     {
         Print("Could not find or open shader file\n");
+        return false;
     }
     
-    // get file size.
-    fseek(fp, 0, SEEK_END);
-    u64 codeSize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    u64 padding = codeSize;
-    codeSize = u64(ceil(codeSize / 4.0)) * 4;
-    padding = codeSize - padding;
-    
-    // read file contents.
-    u8 *shaderCode = (u8 *)malloc(codeSize);
-    fread(shaderCode, codeSize, sizeof(u8), fp);
-    fclose(fp);
-    
-    // data padding. 
-    for (u64 i = codeSize - padding; i < codeSize; i++)
-    {
-        shaderCode[i] = 0;
-    }
-    
-    if(shaderCode)
+    // NOTE(heyyod): SPIR-V is a stream of words starting with the magic number
+    bool success = (codeSize >= 4 && codeSize % 4 == 0 && *(u32 *)shaderCode == 0x07230203);
+    if (success)
     {
         VkShaderModuleCreateInfo shaderInfo = {};
         shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
         shaderInfo.codeSize = codeSize;
         shaderInfo.pCode = (u32 *)shaderCode;
-        VkResult res = vkCreateShaderModule(vulkan.device, &shaderInfo, 0, shaderOut);
-        if (res == VK_SUCCESS)
+        success = vkCreateShaderModule(vulkan.device, &shaderInfo, 0, shaderOut) == VK_SUCCESS;
+    }
+    else
+    {
+        Print("Not a SPIR-V file: " << filepath << '\n');
+    }
+    
+    // NOTE(heyyod): The module keeps its own copy of the code
+    free(shaderCode);
+    if (success)
+        DebugPrint("Loaded Shader\n");
+    return success;
+}
+
+// NOTE(heyyod): The driver validates the cache data itself but a cache from another
+// gpu or driver is useless, so we only hand it over if the header matches this device.
+func void Vulkan::
+LoadPipelineCache()
+{
+    u64 cacheSize = 0;
+    u8 *cacheData = ReadEntireFile(PIPELINE_CACHE_FILEPATH, cacheSize);
+    if (cacheData)
+    {
+        // NOTE(heyyod): Version one header: headerSize, headerVersion, vendorID, deviceID, uuid.
+        // Our vulkan headers predate VkPipelineCacheHeaderVersionOne so we read the words ourselves.
+        u32 *header = (u32 *)cacheData;
+        if (cacheSize < 4 * sizeof(u32) + VK_UUID_SIZE ||
+            header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+            header[2] != vulkan.gpuProperties.vendorID ||
+            header[3] != vulkan.gpuProperties.deviceID ||
+            memcmp(&header[4], vulkan.gpuProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
         {
-            DebugPrint("Loaded Shader\n");
-            return true;
+            DebugPrint("Pipeline cache is from another device or driver. Ignoring it.\n");
+            free(cacheData);
+            cacheData = 0;
+            cacheSize = 0;
         }
     }
-    free(shaderCode);
-    return false;
     
+    VkPipelineCacheCreateInfo cacheInfo = {};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = cacheSize;
+    cacheInfo.pInitialData = cacheData;
+    if (vkCreatePipelineCache(vulkan.device, &cacheInfo, 0, &vulkan.pipelineCache) != VK_SUCCESS)
+    {
+        // NOTE(heyyod): Still works without one, pipelines just get compiled every run
+        vulkan.pipelineCache = VK_NULL_HANDLE;
+    }
+    else if (cacheData)
+    {
+        DebugPrint("Loaded pipeline cache\n");
+    }
+    free(cacheData);
+}
+
+func void Vulkan::
+SavePipelineCache()
+{
+    if (!VulkanIsValidHandle(vulkan.pipelineCache))
+        return;
+    
+    size_t cacheSize = 0;
+    if (vkGetPipelineCacheData(vulkan.device, vulkan.pipelineCache, &cacheSize, 0) == VK_SUCCESS && cacheSize)
+    {
+        u8 *cacheData = (u8 *)malloc(cacheSize);
+        if (vkGetPipelineCacheData(vulkan.device, vulkan.pipelineCache, &cacheSize, cacheData) == VK_SUCCESS)
+        {
+            // NOTE(heyyod): Written next to the old one and moved over it, so a failed write
+            // leaves the previous cache instead of a truncated one
+            char tempPath[1024];
+            snprintf(tempPath, sizeof(tempPath), "%s.tmp", PIPELINE_CACHE_FILEPATH);
+            FILE *file = fopen(tempPath, "wb");
+            bool success = file && fwrite(cacheData, 1, cacheSize, file) == cacheSize;
+            if (file)
+                success = (fclose(file) == 0) && success;
+            success = success && MoveFileOver(tempPath, PIPELINE_CACHE_FILEPATH);
+            if (!success)
+            {
+                remove(tempPath);
+                DebugPrint("Couldn't save the pipeline cache\n");
+            }
+        }
+        free(cacheData);
+    }
+    vkDestroyPipelineCache(vulkan.device, vulkan.pipelineCache, 0);
+    vulkan.pipelineCache = VK_NULL_HANDLE;
 }
 
 func void Vulkan::
@@ -964,20 +1336,30 @@ ClearPipelinesAndStorageBuffers()
             {
                 vkDestroyPipelineLayout(vulkan.device, vulkan.pipelines[i].layout, 0);
             }
+            
+            if (VulkanIsValidHandle(vulkan.pipelines[i].descSetLayout))
+                vkDestroyDescriptorSetLayout(vulkan.device, vulkan.pipelines[i].descSetLayout, 0);
+            vulkan.pipelines[i] = {};
         }
         
-        if(VulkanIsValidHandle(vulkan.globalDescSetLayout))
-            vkDestroyDescriptorSetLayout(vulkan.device, vulkan.globalDescSetLayout, 0);
-        if(VulkanIsValidHandle(vulkan.globalDescPool))
-            vkDestroyDescriptorPool(vulkan.device, vulkan.globalDescPool, 0);
+        // NOTE(heyyod): Frees the descriptor sets too
+        if(VulkanIsValidHandle(vulkan.descPool))
+            vkDestroyDescriptorPool(vulkan.device, vulkan.descPool, 0);
+        vulkan.descPool = VK_NULL_HANDLE;
         
         ClearBuffer(vulkan.weightsBuffer);
         ClearBuffer(vulkan.biasesBuffer);
         ClearBuffer(vulkan.valuesBuffer);
-        ClearBuffer(vulkan.productsBuffer);
         ClearBuffer(vulkan.errorsBuffer);
-        ClearBuffer(vulkan.distPerPixelBuffer);
+        ClearBuffer(vulkan.outputReadbackBuffer);
+        ClearBuffer(vulkan.nnBatchBuffer);
+        ClearBuffer(vulkan.distReadbackBuffer);
+        ClearBuffer(vulkan.knnPixelsBuffer);
         ClearBuffer(vulkan.distPerImgBuffer);
+        ClearBuffer(vulkan.knnBatchBuffer);
+        ClearBuffer(vulkan.knnPartialsBuffer);
+        ClearBuffer(vulkan.knnResultsBuffer);
+        FreeKnnCommands();
     }
 }
 
@@ -985,7 +1367,13 @@ func bool Vulkan::
 CreateBuffer(VkBufferUsageFlags usage, u64 size, VkMemoryPropertyFlags properties, 
              vulkan_buffer &bufferOut, bool mapBuffer)
 {
-    // TODO(heyyod): make this able to create multiple buffers of the same type and usage if I pass an array
+    // NOTE(heyyod): An existing buffer is reused if it is big enough. Otherwise it is replaced
+    // once the gpu is done with it, CreatePipeline then rebinds the new one.
+    if (VulkanIsValidHandle(bufferOut.handle) && size > bufferOut.size)
+    {
+        vkDeviceWaitIdle(vulkan.device);
+        ClearBuffer(bufferOut);
+    }
     if(!(VulkanIsValidHandle(bufferOut.handle)))
     {
         bufferOut.size = size;
@@ -1000,29 +1388,170 @@ CreateBuffer(VkBufferUsageFlags usage, u64 size, VkMemoryPropertyFlags propertie
         VkMemoryRequirements memoryReq= {};
         vkGetBufferMemoryRequirements(vulkan.device, bufferOut.handle, &memoryReq);
         
-        u32 memIndex = 0;
-        if(Vulkan::FindMemoryProperties(memoryReq.memoryTypeBits, properties, memIndex))
+        if(!AllocateBufferMemory(memoryReq, properties, mapBuffer, bufferOut))
         {
-            VkMemoryAllocateInfo allocInfo = {};
-            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-            allocInfo.allocationSize = memoryReq.size;
-            allocInfo.memoryTypeIndex = memIndex;
-            
-            AssertSuccess(vkAllocateMemory(vulkan.device, &allocInfo, 0, &bufferOut.memoryHandle));
-            AssertSuccess(vkBindBufferMemory(vulkan.device, bufferOut.handle, bufferOut.memoryHandle, 0));
-            
-            if(mapBuffer)
-                AssertSuccess(vkMapMemory(vulkan.device, bufferOut.memoryHandle, 0, bufferOut.size, 0, &bufferOut.data));
+            Print("Could not allocate buffer memory\n");
+            ClearBuffer(bufferOut);
+            return false;
         }
-        else
+        AssertSuccess(vkBindBufferMemory(vulkan.device, bufferOut.handle, bufferOut.memoryHandle, bufferOut.memoryOffset));
+    }
+    return true;
+}
+
+// NOTE(heyyod): Finds a free node at the wanted level under node, splitting free nodes on
+// the way down. Returns U32_MAX if the subtree has no room.
+func u32
+BuddyAllocate(u8 *nodes, u32 node, u32 nodeLevel, u32 level)
+{
+    if (nodes[node] == BUDDY_NODE_USED)
+        return U32_MAX;
+    
+    if (nodeLevel == level)
+    {
+        if (nodes[node] != BUDDY_NODE_FREE)
+            return U32_MAX;
+        nodes[node] = BUDDY_NODE_USED;
+        return node;
+    }
+    
+    bool wasFree = (nodes[node] == BUDDY_NODE_FREE);
+    nodes[node] = BUDDY_NODE_SPLIT;
+    u32 found = BuddyAllocate(nodes, 2 * node + 1, nodeLevel + 1, level);
+    if (found == U32_MAX)
+        found = BuddyAllocate(nodes, 2 * node + 2, nodeLevel + 1, level);
+    if (found == U32_MAX && wasFree)
+        nodes[node] = BUDDY_NODE_FREE;
+    return found;
+}
+
+// NOTE(heyyod): Frees the node and merges it with its buddy as long as the buddy is free too
+func void
+BuddyFree(u8 *nodes, u32 node)
+{
+    nodes[node] = BUDDY_NODE_FREE;
+    while (node > 0)
+    {
+        u32 buddy = (node & 1) ? node + 1 : node - 1;
+        if (nodes[buddy] != BUDDY_NODE_FREE)
+            break;
+        node = (node - 1) / 2;
+        nodes[node] = BUDDY_NODE_FREE;
+    }
+}
+
+func u64
+BuddyNodeOffset(u32 node, u32 level)
+{
+    u32 firstNodeOfLevel = (1 << level) - 1;
+    return (u64)(node - firstNodeOfLevel) * (MEMORY_BLOCK_SIZE >> level);
+}
+
+func bool Vulkan::
+AllocateBufferMemory(VkMemoryRequirements &memoryReq, VkMemoryPropertyFlags properties, bool mapBuffer, vulkan_buffer &buffer)
+{
+    u32 memIndex = 0;
+    if (!FindMemoryProperties(memoryReq.memoryTypeBits, properties, memIndex))
+        return false;
+    bool hostVisible = (vulkan.memoryProperties.memoryTypes[memIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    
+    // NOTE(heyyod): Nodes are aligned to their size, so a node at least as big as the
+    // alignment satisfies it
+    u64 nodeSize = Max(MEMORY_MIN_NODE_SIZE, (u64)memoryReq.alignment);
+    while (nodeSize < memoryReq.size)
+        nodeSize *= 2;
+    
+    if (nodeSize > MEMORY_BLOCK_SIZE)
+    {
+        VkMemoryAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = memoryReq.size;
+        allocInfo.memoryTypeIndex = memIndex;
+        AssertSuccess(vkAllocateMemory(vulkan.device, &allocInfo, 0, &buffer.memoryHandle));
+        buffer.block = 0;
+        buffer.memoryOffset = 0;
+        if (mapBuffer)
+            AssertSuccess(vkMapMemory(vulkan.device, buffer.memoryHandle, 0, buffer.size, 0, &buffer.data));
+        return true;
+    }
+    
+    u32 level = 0;
+    while ((MEMORY_BLOCK_SIZE >> level) > nodeSize)
+        level++;
+    
+    vulkan_memory_block *block = 0;
+    u32 node = U32_MAX;
+    for (u32 i = 0; i < vulkan.nMemoryBlocks && node == U32_MAX; i++)
+    {
+        if (vulkan.memoryBlocks[i].memoryTypeIndex == memIndex)
+        {
+            block = &vulkan.memoryBlocks[i];
+            node = BuddyAllocate(block->nodes, 0, 0, level);
+        }
+    }
+    
+    if (node == U32_MAX)
+    {
+        if (vulkan.nMemoryBlocks == MAX_MEMORY_BLOCKS)
+            return false;
+        
+        block = &vulkan.memoryBlocks[vulkan.nMemoryBlocks];
+        *block = {};
+        block->memoryTypeIndex = memIndex;
+        
+        VkMemoryAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = MEMORY_BLOCK_SIZE;
+        allocInfo.memoryTypeIndex = memIndex;
+        if (vkAllocateMemory(vulkan.device, &allocInfo, 0, &block->handle) != VK_SUCCESS)
+            return false;
+        if (hostVisible && vkMapMemory(vulkan.device, block->handle, 0, VK_WHOLE_SIZE, 0, (void **)&block->mapped) != VK_SUCCESS)
         {
-            Assert("Could not allocate vertex buffer memory");
+            vkFreeMemory(vulkan.device, block->handle, 0);
             return false;
         }
+        block->nodes = (u8 *)calloc(MEMORY_BLOCK_NODES, sizeof(u8));
+        vulkan.nMemoryBlocks++;
+        DebugPrint("Allocated a new memory block\n");
+        
+        node = BuddyAllocate(block->nodes, 0, 0, level);
+    }
+    
+    buffer.block = block;
+    buffer.node = node;
+    buffer.memoryOffset = BuddyNodeOffset(node, level);
+    buffer.memoryHandle = block->handle;
+    if (mapBuffer)
+    {
+        Assert(block->mapped);
+        buffer.data = block->mapped + buffer.memoryOffset;
     }
     return true;
 }
 
+func void Vulkan::
+FreeBufferMemory(vulkan_buffer &buffer)
+{
+    if (buffer.block)
+        BuddyFree(buffer.block->nodes, buffer.node);
+    else if (VulkanIsValidHandle(buffer.memoryHandle))
+        vkFreeMemory(vulkan.device, buffer.memoryHandle, 0);
+}
+
+// NOTE(heyyod): Empty blocks are kept around for the next buffers, they only go away here
+func void Vulkan::
+FreeMemoryBlocks()
+{
+    for (u32 i = 0; i < vulkan.nMemoryBlocks; i++)
+    {
+        vulkan_memory_block &block = vulkan.memoryBlocks[i];
+        vkFreeMemory(vulkan.device, block.handle, 0);
+        free(block.nodes);
+        block = {};
+    }
+    vulkan.nMemoryBlocks = 0;
+}
+
 func void Vulkan::
 ClearBuffer(vulkan_buffer &buffer)
 {
@@ -1033,11 +1562,9 @@ ClearBuffer(vulkan_buffer &buffer)
             vkDestroyBuffer(vulkan.device, buffer.handle, 0);
             buffer.handle = VK_NULL_HANDLE;
         }
-        if(VulkanIsValidHandle(buffer.memoryHandle))
-        {
-            vkFreeMemory(vulkan.device, buffer.memoryHandle, 0);
-        }
+        FreeBufferMemory(buffer);
     }
+    buffer = {};
 }
 
 func void Vulkan::
@@ -1048,7 +1575,11 @@ Destroy()
         vkDeviceWaitIdle(vulkan.device);
         
         ClearPipelinesAndStorageBuffers();
+        FreeMemoryBlocks();
+        SavePipelineCache();
         
+        if (VulkanIsValidHandle(vulkan.queryPool))
+            vkDestroyQueryPool(vulkan.device, vulkan.queryPool, 0);
         if(VulkanIsValidHandle(vulkan.cmdPool))
             vkDestroyCommandPool(vulkan.device, vulkan.cmdPool, 0);
         
@@ -1066,7 +1597,14 @@ Destroy()
     }
     
     if (vulkan.dll)
+    {
+#ifdef _WIN32
         FreeLibrary(vulkan.dll);
+#else
+        dlclose(vulkan.dll);
+#endif
+        vulkan.dll = 0;
+    }
     
     DebugPrint("Destroyed Vulkan\n");
     return;
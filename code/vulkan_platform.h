@@ -2,15 +2,46 @@
 #define HY3D_VULKAN_H 1
 
 #include "hy3d_base.h"
+#include "gpu_profiler.h"
 
+// NOTE(heyyod): We only do compute, so we never need a surface. The win32 platform is only
+// there for the HMODULE of the loader.
+#ifdef _WIN32
 #define VK_USE_PLATFORM_WIN32_KHR
+#else
+#include <dlfcn.h>
+#endif
 #define VK_NO_PROTOTYPES
-#include "vulkan\vulkan.h"
+#include "vulkan/vulkan.h"
 
 #define SHADER_CODE_BUFFER_SIZE 4096
-#define WORKGROUP_SIZE 256
 #define MAP_BUFFER_TRUE true
 
+// NOTE(heyyod): Buffers get their memory from big blocks that are split with a buddy
+// allocator. Each block is a binary tree of nodes, level 0 being the whole block and level l
+// having nodes of MEMORY_BLOCK_SIZE >> l bytes. Anything bigger than a block gets its own
+// dedicated allocation.
+#define MEMORY_BLOCK_SIZE MEGABYTES(64)
+#define MEMORY_MIN_NODE_SIZE KILOBYTES(4)
+#define MEMORY_BLOCK_LEVELS 15 // log2(MEMORY_BLOCK_SIZE / MEMORY_MIN_NODE_SIZE) + 1
+#define MEMORY_BLOCK_NODES ((1 << MEMORY_BLOCK_LEVELS) - 1)
+#define MAX_MEMORY_BLOCKS 32
+
+enum buddy_node_state
+{
+    BUDDY_NODE_FREE,  // the node and all its children are free
+    BUDDY_NODE_SPLIT, // some of the children are used
+    BUDDY_NODE_USED,
+};
+
+struct vulkan_memory_block
+{
+    VkDeviceMemory handle;
+    u32 memoryTypeIndex;
+    u8 *mapped; // the whole block stays mapped if its memory is host visible
+    u8 *nodes;  // buddy_node_state per node, node n has children 2n+1 and 2n+2
+};
+
 struct vulkan_buffer
 {
     VkBuffer handle;
@@ -18,30 +49,116 @@ struct vulkan_buffer
     void *data;
     u64 size;
     u64 writeOffset;
+    
+    vulkan_memory_block *block; // 0 for dedicated allocations
+    u64 memoryOffset;
+    u32 node;
 };
 
+#define MAX_PIPELINE_BINDINGS 8
+#define PIPELINE_CACHE_FILEPATH "../build/pipeline.cache"
+
 struct vulkan_pipeline
 {
     VkPipeline handle;
     VkPipelineLayout layout;
+    VkDescriptorSetLayout descSetLayout;
+    VkDescriptorSet descSet;
+    VkBuffer boundBuffers[MAX_PIPELINE_BINDINGS]; // what descSet points to
 };
 
+// NOTE(heyyod): Number of test images one knn command buffer dispatches. Each one gets
+// its own slice of the distPerImg buffer.
+#define KNN_GPU_BATCH_SIZE 64
+
+// NOTE(heyyod): Number of batches in flight. While the gpu computes the distances of one
+// slot the cpu runs the top-k of another. 1 makes everything serial again.
+#define KNN_GPU_SLOTS 2
+
+// NOTE(heyyod): Largest k the gpu top-k supports. Must match MAX_K in KnnTopK.comp.
+// Bigger k falls back to reading the whole distance row back to the cpu.
+#define KNN_GPU_MAX_K 8
+#define KNN_TOP_K_CHUNK_SIZE 4096
+
+// NOTE(heyyod): Test and train images per workgroup. Must match NearestNeighbour.comp.
+#define KNN_TILE_TESTS 16
+#define KNN_TILE_TRAIN 64
+
+// NOTE(heyyod): The knn shader reads the pixels 4 at a time, see UploadKnnPixels
+#define KnnWordsPerImage(pixelsPerImg) (((pixelsPerImg) + 3) / 4)
+
 struct push_constants_knn
 {
-    u32 testId;
+    u32 slot;       // the batch's first test image is knnBatchBuffer[slot]
+    u32 nTests;
+    u32 nTrainImages;
+    u32 wordsPerImage;
+    u32 distOffset; // where the slot's rows start in the distPerImg buffer
+    u32 distP;
+};
+
+struct push_constants_knn_top_k
+{
+    u32 stage; // 0: top-k per chunk of a row, 1: merge the chunks of a row
+    u32 k;
+    u32 nDists;
+    u32 chunkSize;
+    u32 nChunks;
+    u32 distOffset;
+    u32 partialsOffset;
+    u32 resultsOffset;
+};
+
+struct gpu_neighbour
+{
+    u32 dist;
+    u32 trainIndex; // U32_MAX when there were fewer than k train images
+};
+
+// NOTE(heyyod): The knn dispatches only differ in the test image, which the shader reads
+// from knnBatchBuffer. So the command buffers are recorded once and replayed for every
+// batch. The tail batch (nTest % KNN_GPU_BATCH_SIZE) gets its own command buffer.
+struct knn_slot
+{
+    VkCommandBuffer fullBatch;
+    VkCommandBuffer tailBatch;
+    u32 tailBatchSize;
+    VkFence fence;
+    bool inFlight;
+    bool done; // KnnPoll saw the fence signaled, the round trip is already recorded
+    std::chrono::steady_clock::time_point submitTime;
+};
+
+struct knn_commands
+{
+    knn_slot slots[KNN_GPU_SLOTS];
+    u32 distP;
+    u32 nTrainImages;
+    u32 k; // 0 when the top-k runs on the cpu
+    u32 wordsPerImage;
+};
+
+// NOTE(heyyod): A neural net submit is one command buffer for a whole batch, the dispatches of
+// every layer one after the other. The shaders read the batch's images and labels from
+// nnBatchBuffer, see BeginNeuralNetCommands.
+struct nn_commands
+{
+    u32 batchSize; // most images of a submit
+    bool fedForward;     // the feed forward timestamps got written
+    bool backPropagated; // the back propagation timestamps got written
+    std::chrono::steady_clock::time_point recordTime;
 };
 
 struct push_constants_feed_forward
 {
-    u32 inValuesIndex;
+    u32 inValuesIndex; // the input layer: where the images start
     u32 inValuesDim;
     u32 weightsIndex;
     u32 weightsDim;
     u32 biasesIndex;
     u32 outValuesIndex;
     u32 outValuesDim;
-    u32 batch;
-    u32 maxBatches;
+    u32 inputLayer;
 };
 
 struct push_constants_back_propagate
@@ -57,13 +174,22 @@ struct push_constants_back_propagate
     u32 outErrorsDim;
     float learningRate;
     u32 layerIndex;
-    u32 batch;
-    u32 maxBatches;
+    u32 nImages;
+    u32 outputLayer; // the errors come from the labels of the batch
 };
 
+// NOTE(heyyod): Timestamp queries of the profiler. Every knn slot owns a begin/end pair for
+// the distances and one for the top-k. The feed forward and the back propagation of a batch get
+// a pair each for all their layers, the nn submits wait idle.
+#define QUERIES_PER_KNN_SLOT 4
+#define QUERY_FEED_FORWARD (KNN_GPU_SLOTS * QUERIES_PER_KNN_SLOT)
+#define QUERY_BACK_PROPAGATE (QUERY_FEED_FORWARD + 2)
+#define QUERY_COUNT (QUERY_BACK_PROPAGATE + 2)
+
 enum pipeline_type
 {
     PIPELINE_TYPE_NEAREST_NEIGHBOUR,
+    PIPELINE_TYPE_KNN_TOP_K,
     PIPELINE_TYPE_FEED_FORWARD,
     PIPELINE_TYPE_BACK_PROPAGATE,
     
@@ -81,26 +207,38 @@ struct vulkan_engine
     
     VkQueue computeQueue;
     u32 computeQueueFamilyIndex;
+    u32 timestampValidBits; // 0 when the compute queue can't write timestamps
+    
+    VkQueryPool queryPool; // VK_NULL_HANDLE when not profiling
     
-    VkDescriptorSetLayout globalDescSetLayout;
-    VkDescriptorPool globalDescPool;
-    VkDescriptorSet globalDescSet;
+    VkDescriptorPool descPool;
+    
+    // NOTE(heyyod): Loaded from and saved to PIPELINE_CACHE_FILEPATH so the driver can skip
+    // compiling the shaders on later runs
+    VkPipelineCache pipelineCache;
     
     vulkan_pipeline pipelines[PIPEPLINE_TYPE_COUNT];
     
+    vulkan_memory_block memoryBlocks[MAX_MEMORY_BLOCKS];
+    u32 nMemoryBlocks;
+    
     // NOTE(heyyod): Neural network buffers
     vulkan_buffer valuesBuffer; // Input data and neurons' out values buffers
     vulkan_buffer weightsBuffer;
     vulkan_buffer biasesBuffer;
     vulkan_buffer errorsBuffer;
-    
-    // productsBuffer is used as a temp buffer to calculate the products wi * xi or wi*ei
-    // Their sum goes to the values buffer or errors buffer
-    vulkan_buffer productsBuffer;
+    vulkan_buffer outputReadbackBuffer; // output layer values of the batch after CopyOutputCompute
+    vulkan_buffer nnBatchBuffer; // image index and label pairs of the batch
+    nn_commands nnCommands;
     
     // NOTE(heyyod): K-NN and NC buffers
-    vulkan_buffer distPerPixelBuffer;
+    vulkan_buffer knnPixelsBuffer; // train then test images, see UploadKnnPixels
     vulkan_buffer distPerImgBuffer;
+    vulkan_buffer knnBatchBuffer;
+    vulkan_buffer knnPartialsBuffer; // top-k of every chunk of a distance row
+    vulkan_buffer knnResultsBuffer;  // top-k of every distance row
+    vulkan_buffer distReadbackBuffer; // host copy of the rows when the top-k runs on the cpu
+    knn_commands knnCommands;
     
     // NOTE(heyyod): We have a set of resources that we use in a circular way to prepare
     // the next frame. For now the number of resources is the same as the swapchain images.
@@ -112,8 +250,10 @@ struct vulkan_engine
     VkDebugUtilsMessengerEXT debugMessenger;
 #endif
     
-#ifdef VK_USE_PLATFORM_WIN32_KHR
+#ifdef _WIN32
     HMODULE dll;
+#else
+    void *dll;
 #endif
 };
 
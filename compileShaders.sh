@@ -0,0 +1,8 @@
+#!/bin/sh
+echo "Compiling Shaders..."
+
+mkdir -p build/shaders
+for f in shaders/*.comp; do
+	echo "$f"
+	glslc "$f" -o "build/shaders/$(basename "$f" .comp).comp.spv"
+done